@@ -0,0 +1,36 @@
+#include "Clock.hh"
+
+using namespace fsm;
+
+namespace {
+  std::shared_ptr<Clock>& ownedclock()
+  {
+    static std::shared_ptr<Clock> clock(new SystemClock);
+    return clock;
+  }
+
+  //raw pointer so mstick() doesn't touch the shared_ptr refcount
+  std::atomic<Clock*>& activeclock()
+  {
+    static std::atomic<Clock*> clock(ownedclock().get());
+    return clock;
+  }
+};
+
+mstick_t fsm::mstick()
+{
+  return activeclock().load(std::memory_order_acquire)->Now();
+}
+
+void fsm::SetClock(std::shared_ptr<Clock> clock)
+{
+  if(!clock)
+    clock.reset(new SystemClock);
+  activeclock().store(clock.get(), std::memory_order_release);
+  ownedclock() = clock;
+}
+
+std::shared_ptr<Clock> fsm::GetClock()
+{
+  return ownedclock();
+}
@@ -0,0 +1,51 @@
+#ifndef CLOCK_h
+#define CLOCK_h
+
+#include <atomic>
+#include <memory>
+#include "define.hh"
+
+namespace fsm{
+
+  ///Source of time for everything in the library that calls mstick()
+  class Clock{
+  public:
+    virtual ~Clock() {}
+    ///Current time in ms
+    virtual mstick_t Now() const = 0;
+  };
+
+  ///Wall clock time in ms since the UNIX epoch; the default
+  class SystemClock : public Clock{
+  public:
+    mstick_t Now() const {
+      using namespace std::chrono;
+      return duration_cast<milliseconds>(system_clock::now()
+					 .time_since_epoch()).count();
+    }
+  };
+
+  ///Clock that only moves when told to, for simulation and testing
+  class VirtualClock : public Clock{
+  public:
+    VirtualClock(mstick_t start=0) : _now(start) {}
+    mstick_t Now() const { return _now.load(std::memory_order_relaxed); }
+    void Set(mstick_t now){ _now.store(now, std::memory_order_relaxed); }
+    void Advance(mstick_t dt){ _now.fetch_add(dt, std::memory_order_relaxed); }
+  private:
+    std::atomic<mstick_t> _now;
+  };
+
+  /** Replace the library-wide clock; nullptr restores the SystemClock.
+      Not synchronized with concurrent mstick() callers on other threads,
+      so swap clocks only while the machines using them are idle. The
+      library's own background threads (the log writer, the thread pool)
+      never call mstick().
+  */
+  void SetClock(std::shared_ptr<Clock> clock);
+
+  ///Get the library-wide clock
+  std::shared_ptr<Clock> GetClock();
+};
+
+#endif
@@ -1,5 +1,5 @@
 #ifndef EVENTHANDLER_h
-#define EVNETHANDLER_h
+#define EVENTHANDLER_h
 
 #include <functional>
 #include "define.hh"
@@ -0,0 +1,254 @@
+#include "Logger.hh"
+#include <chrono>
+#include <iomanip>
+
+using namespace fsm;
+
+static const char* levelname(LOGLEVEL level)
+{
+  switch(level){
+  case LOG_DEBUG:   return "DEBUG";
+  case LOG_INFO:    return "INFO";
+  case LOG_WARNING: return "WARNING";
+  case LOG_ERROR:   return "ERROR";
+  }
+  return "?";
+}
+
+std::ostream& fsm::operator<<(std::ostream& out, const LogRecord& rec)
+{
+  out<<'['<<rec.time<<"] "<<levelname(rec.level);
+  if(rec.machine)
+    out<<" machine="<<rec.machine;
+  if(!rec.state.empty())
+    out<<" state="<<rec.state;
+  if(rec.status)
+    out<<" status="<<rec.status;
+  return out<<": "<<rec.msg;
+}
+
+/**** StreamLogSink ****/
+
+void StreamLogSink::Write(LogRecord&& rec)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  _out<<rec<<'\n';
+}
+
+void StreamLogSink::Flush()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  _out.flush();
+}
+
+/**** AsyncLogSink ****/
+
+static size_t roundpow2(size_t n)
+{
+  size_t r = 2;
+  while(r < n) r <<= 1;
+  return r;
+}
+
+AsyncLogSink::AsyncLogSink(std::ostream& out, size_t queuesize,
+			   unsigned maxpersecond, mstick_t dedupwindow) :
+  _out(out), _cells(roundpow2(queuesize)), _mask(_cells.size()-1),
+  _enqueue_pos(0), _dequeue_pos(0), _maxpersecond(maxpersecond),
+  _ratewindow(0), _ninwindow(0), _ndropped_full(0), _ndropped_rate(0),
+  _nduplicates(0), _dedupwindow(dedupwindow), _stop(false), _nwritten(0)
+{
+  for(size_t i=0; i<_cells.size(); ++i)
+    _cells[i].seq.store(i, std::memory_order_relaxed);
+  _writer = std::thread(&AsyncLogSink::WriterLoop, this);
+}
+
+AsyncLogSink::~AsyncLogSink()
+{
+  _stop = true;
+  _wake.notify_one();
+  _writer.join();
+}
+
+//bounded MPMC queue after D. Vyukov; each cell's sequence number tells
+//producers and the consumer whose turn it is
+bool AsyncLogSink::TryPush(LogRecord&& rec)
+{
+  size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+  for(;;){
+    Cell& cell = _cells[pos & _mask];
+    size_t seq = cell.seq.load(std::memory_order_acquire);
+    intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+    if(dif == 0){
+      if(_enqueue_pos.compare_exchange_weak(pos, pos+1,
+					    std::memory_order_relaxed)){
+	cell.rec = std::move(rec);
+	cell.seq.store(pos+1, std::memory_order_release);
+	return true;
+      }
+    }
+    else if(dif < 0)
+      return false; //full
+    else
+      pos = _enqueue_pos.load(std::memory_order_relaxed);
+  }
+}
+
+bool AsyncLogSink::TryPop(LogRecord& rec)
+{
+  size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+  Cell& cell = _cells[pos & _mask];
+  size_t seq = cell.seq.load(std::memory_order_acquire);
+  if((intptr_t)seq - (intptr_t)(pos+1) < 0)
+    return false; //empty
+  //only the writer thread pops, so no CAS needed
+  _dequeue_pos.store(pos+1, std::memory_order_relaxed);
+  rec = std::move(cell.rec);
+  cell.seq.store(pos + _mask + 1, std::memory_order_release);
+  return true;
+}
+
+void AsyncLogSink::Write(LogRecord&& rec)
+{
+  if(_maxpersecond){
+    mstick_t window = SteadyNow() / 1000;
+    mstick_t current = _ratewindow.load(std::memory_order_relaxed);
+    if(window > current &&
+       _ratewindow.compare_exchange_strong(current, window))
+      _ninwindow.store(0, std::memory_order_relaxed);
+    if(_ninwindow.fetch_add(1, std::memory_order_relaxed) >= _maxpersecond){
+      ++_ndropped_rate;
+      return;
+    }
+  }
+  if(!TryPush(std::move(rec)))
+    ++_ndropped_full;
+}
+
+mstick_t AsyncLogSink::SteadyNow()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>
+    (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void AsyncLogSink::Flush()
+{
+  size_t target = _enqueue_pos.load();
+  _wake.notify_one();
+  while(_nwritten.load() < target && !_stop)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+void AsyncLogSink::Output(const LogRecord& rec, mstick_t now)
+{
+  if(_dedupwindow > 0){
+    for(auto& dup : _recent){
+      if(dup.first.level == rec.level && dup.first.status == rec.status &&
+	 dup.first.msg == rec.msg){
+	++dup.repeats;
+	++_nduplicates;
+	return;
+      }
+    }
+    //keep the table small; it's scanned for every record
+    static const size_t MAXRECENT = 64;
+    if(_recent.size() < MAXRECENT)
+      _recent.push_back(DupEntry{rec, now, 0});
+  }
+  _out<<rec<<'\n';
+}
+
+void AsyncLogSink::ExpireDuplicates(mstick_t now, bool all)
+{
+  for(size_t i=0; i<_recent.size(); ){
+    DupEntry& dup = _recent[i];
+    if(all || now - dup.start >= _dedupwindow){
+      if(dup.repeats)
+	_out<<levelname(dup.first.level)<<": last message (\""<<dup.first.msg
+	    <<"\") repeated "<<dup.repeats<<" more times\n";
+      _recent[i] = std::move(_recent.back());
+      _recent.pop_back();
+    }
+    else
+      ++i;
+  }
+  size_t nfull = _ndropped_full.load(), nrate = _ndropped_rate.load();
+  if(nfull > _nreported_full || nrate > _nreported_rate){
+    _out<<"WARNING: log queue dropped "<<nfull - _nreported_full
+	<<" messages (full) and "<<nrate - _nreported_rate
+	<<" messages (rate limit)\n";
+    _nreported_full = nfull;
+    _nreported_rate = nrate;
+  }
+}
+
+void AsyncLogSink::WriterLoop()
+{
+  LogRecord rec;
+  for(;;){
+    bool stopping = _stop.load();
+    bool any = false;
+    while(TryPop(rec)){
+      Output(rec, SteadyNow());
+      ++_nwritten;
+      any = true;
+    }
+    ExpireDuplicates(SteadyNow(), stopping);
+    if(any)
+      _out.flush();
+    if(stopping)
+      break;
+    std::unique_lock<std::mutex> lock(_wakemutex);
+    _wake.wait_for(lock, std::chrono::milliseconds(10));
+  }
+  _out.flush();
+}
+
+/**** global sink ****/
+
+namespace {
+  ///Every sink ever installed; the last one is current. Earlier ones stay
+  ///alive because a Log() racing with SetLogSink may still hold them.
+  std::vector<std::shared_ptr<LogSink> >& ownedsinks()
+  {
+    static std::vector<std::shared_ptr<LogSink> >
+      sinks(1, std::shared_ptr<LogSink>(new AsyncLogSink));
+    return sinks;
+  }
+
+  std::mutex& sinkmutex()
+  {
+    static std::mutex mutex;
+    return mutex;
+  }
+
+  //raw pointer so Log() doesn't lock or touch the shared_ptr refcount
+  std::atomic<LogSink*>& activesink()
+  {
+    static std::atomic<LogSink*> sink(ownedsinks().back().get());
+    return sink;
+  }
+};
+
+void fsm::SetLogSink(std::shared_ptr<LogSink> sink)
+{
+  std::lock_guard<std::mutex> lock(sinkmutex());
+  if(!sink)
+    sink = ownedsinks().front();
+  LogSink* old = activesink().load(std::memory_order_relaxed);
+  ownedsinks().push_back(sink);
+  activesink().store(sink.get(), std::memory_order_release);
+  old->Flush();
+}
+
+std::shared_ptr<LogSink> fsm::GetLogSink()
+{
+  std::lock_guard<std::mutex> lock(sinkmutex());
+  return ownedsinks().back();
+}
+
+void fsm::Log(LogRecord&& rec)
+{
+  if(rec.time == 0)
+    rec.time = mstick();
+  activesink().load(std::memory_order_acquire)->Write(std::move(rec));
+}
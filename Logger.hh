@@ -0,0 +1,151 @@
+#ifndef LOGGER_h
+#define LOGGER_h
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+#include "define.hh"
+#include "Clock.hh"
+
+namespace fsm{
+
+  enum LOGLEVEL { LOG_DEBUG = 0, LOG_INFO, LOG_WARNING, LOG_ERROR };
+
+  ///One diagnostic message plus the structured fields describing its source
+  struct LogRecord{
+    LOGLEVEL level = LOG_INFO;
+    mstick_t time = 0;             ///< filled in by Log() if left at 0
+    const void* machine = nullptr; ///< StateMachine that produced the message
+    std::string state;             ///< name of the relevant state, if any
+    status_t status = 0;           ///< status code at the time of the message
+    std::string msg;
+  };
+
+  ///Write a record in the default human-readable format
+  std::ostream& operator<<(std::ostream& out, const LogRecord& rec);
+
+  ///Abstract destination for log records. Write may be called concurrently
+  ///from any thread, and from inside event handlers, so it must not block.
+  class LogSink{
+  public:
+    virtual ~LogSink() {}
+    virtual void Write(LogRecord&& rec) = 0;
+    ///Wait until everything written so far has been output
+    virtual void Flush() {}
+  };
+
+  ///Synchronous sink writing directly to a stream; serializes on a mutex
+  class StreamLogSink : public LogSink{
+  public:
+    StreamLogSink(std::ostream& out=std::cerr) : _out(out) {}
+    void Write(LogRecord&& rec);
+    void Flush();
+  private:
+    std::ostream& _out;
+    std::mutex _mutex;
+  };
+
+  /** Default sink: records go into a bounded lock-free queue and are written
+      by a background thread. Write never waits; if the queue is full or the
+      rate limit is exceeded the record is dropped and counted instead.
+      Identical messages (same level, status, and text) arriving within
+      `dedupwindow` ms of each other are collapsed into a repeat count.
+      Both windows are timed with std::chrono::steady_clock; LogRecord::time
+      comes from the swappable library clock and is only ever displayed.
+  */
+  class AsyncLogSink : public LogSink{
+  public:
+    AsyncLogSink(std::ostream& out=std::cerr, size_t queuesize=4096,
+		 unsigned maxpersecond=1000, mstick_t dedupwindow=1000);
+    ~AsyncLogSink();
+
+    void Write(LogRecord&& rec);
+    void Flush();
+
+    ///Number of records dropped because the queue was full
+    size_t GetNDroppedFull() const { return _ndropped_full; }
+    ///Number of records dropped by the rate limit
+    size_t GetNDroppedRate() const { return _ndropped_rate; }
+    ///Number of records collapsed into a repeat count
+    size_t GetNDuplicates() const { return _nduplicates; }
+
+  private:
+    struct Cell{
+      std::atomic<size_t> seq;
+      LogRecord rec;
+    };
+    bool TryPush(LogRecord&& rec);
+    bool TryPop(LogRecord& rec);
+    void WriterLoop();
+    void Output(const LogRecord& rec, mstick_t now);
+    void ExpireDuplicates(mstick_t now, bool all);
+    ///Milliseconds on the steady clock
+    static mstick_t SteadyNow();
+
+    std::ostream& _out;
+    std::vector<Cell> _cells;
+    const size_t _mask;
+    //keep producer and consumer positions on separate cache lines
+    char _pad0[64];
+    std::atomic<size_t> _enqueue_pos;
+    char _pad1[64];
+    std::atomic<size_t> _dequeue_pos;
+    char _pad2[64];
+
+    //rate limiting: count records in the current 1-second window
+    const unsigned _maxpersecond;
+    std::atomic<mstick_t> _ratewindow;
+    std::atomic<unsigned> _ninwindow;
+
+    std::atomic<size_t> _ndropped_full;
+    std::atomic<size_t> _ndropped_rate;
+    std::atomic<size_t> _nduplicates;
+    size_t _nreported_full = 0;
+    size_t _nreported_rate = 0;
+
+    //deduplication state; only touched by the writer thread
+    struct DupEntry{ LogRecord first; mstick_t start; size_t repeats; };
+    const mstick_t _dedupwindow;
+    std::vector<DupEntry> _recent;
+
+    std::atomic<bool> _stop;
+    std::atomic<size_t> _nwritten;
+    std::mutex _wakemutex;
+    std::condition_variable _wake;
+    std::thread _writer;
+  };
+
+  /** Replace the library-wide log sink; nullptr restores the original
+      default sink.
+      The replaced sink is flushed but kept alive until exit, since Log()
+      may still be using it on another thread. Meant for setup and
+      teardown, not for switching sinks at high frequency.
+  */
+  void SetLogSink(std::shared_ptr<LogSink> sink);
+
+  ///Get the current library-wide log sink
+  std::shared_ptr<LogSink> GetLogSink();
+
+  ///Send a record to the current sink
+  void Log(LogRecord&& rec);
+
+  ///Convenience to log a plain message
+  inline void Log(LOGLEVEL level, const std::string& msg,
+		  const void* machine=nullptr, const std::string& state="",
+		  status_t status=0){
+    LogRecord rec;
+    rec.level = level;
+    rec.machine = machine;
+    rec.state = state;
+    rec.status = status;
+    rec.msg = msg;
+    Log(std::move(rec));
+  }
+};
+
+#endif
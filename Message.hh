@@ -1,3 +1,6 @@
+#ifndef MESSAGE_h
+#define MESSAGE_h
+
 #include <string>
 #include <vector>
 #include <algorithm>
@@ -33,6 +36,9 @@ namespace fsm{
     
     ///event type identifier
     event_t event;
+
+    ///number of raw events this stands for; >1 if queued copies coalesced
+    unsigned count = 1;
     
     ///pointer to the data location
     void* GetData()
@@ -47,7 +53,7 @@ namespace fsm{
 
     ///format the data as a string. May not be a valid c-string though!
     const char* GetDataString() const 
-    { return _data ? (const char*)GetData() : ""; }
+    { return GetData() ? (const char*)GetData() : ""; }
 
   private:
     void* _data = nullptr;
@@ -57,3 +63,4 @@ namespace fsm{
 
 };
 
+#endif
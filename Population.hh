@@ -0,0 +1,328 @@
+#ifndef POPULATION_h
+#define POPULATION_h
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <map>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include "StateMachine.hh"
+
+namespace fsm{
+
+  /** Many small machines sharing one topology, stored structure-of-arrays.
+
+      Each machine is just a state index plus a `Data` value, held in two
+      contiguous arrays. Transitions registered with RegisterTransition are
+      compiled into one lookup table per event, so applying an event to a
+      batch of machines is a tight gather/lookup/scatter loop. ApplyAll on
+      an event that moves only a few states uses a compare-and-blend
+      kernel instead, which the compiler vectorizes.
+
+      Handlers registered with RegisterEventHandler run through a regular
+      StateMachine instead: for each affected machine the state object is
+      created, the handler called, and the resulting state read back. Such
+      state objects only live for one event; per-machine data belongs in
+      GetData(). Handlers can find the machine they are running for with
+      Population<Data>::GetMachine(st).
+  */
+  template<class Data=uint32_t> class Population{
+  public:
+    using machineid_t = uint32_t;
+    using stateidx_t = uint8_t;
+    static const stateidx_t NOSTATE = 255;
+
+    ///StateMachine used for handler fallback; tells handlers who they serve
+    class Machine : public StateMachine{
+    public:
+      Machine(Population& pop) : _pop(pop) {}
+      Population& GetPopulation() const { return _pop; }
+      machineid_t GetMachineID() const { return _id; }
+      Data& GetData() const { return _pop.GetData(_id); }
+    private:
+      friend class Population;
+      Population& _pop;
+      machineid_t _id = 0;
+    };
+
+    ///Get the fallback machine from within a handler
+    static Machine* GetMachine(VState* st)
+    { return static_cast<Machine*>(st->GetStateMachine()); }
+
+    ///Create `nmachines` machines with no state and default data
+    Population(size_t nmachines=0) : _scratch(*this) {
+      RegisterState<StateMachine::DefaultErrorHandler>("DefaultErrorHandler");
+      Resize(nmachines);
+    }
+
+    ///Change the number of machines; new ones have no state
+    void Resize(size_t nmachines){
+      _state.resize(nmachines, NOSTATE);
+      _data.resize(nmachines);
+    }
+
+    ///Number of machines
+    size_t GetSize() const { return _state.size(); }
+
+    ///Register a state class; returns its dense index
+    template<class T> stateidx_t RegisterState(const std::string& name=""){
+      _scratch.template RegisterState<T>(name);
+      stateid_t id = GetStateID<T>();
+      auto it = _index.find(id);
+      if(it != _index.end())
+	return it->second;
+      if(_ids.size() >= NOSTATE)
+	throw std::length_error("Population supports at most 254 states");
+      stateidx_t idx = _ids.size();
+      _ids.push_back(id);
+      _index[id] = idx;
+      for(auto& tab : _tables)
+	tab.second.slow[idx] = tab.second.allslow;
+      return idx;
+    }
+
+    ///Table-driven transition: in state `from`, `evt` moves to state `to`
+    int RegisterTransition(const event_t& evt, const stateid_t& from,
+			   const stateid_t& to){
+      stateidx_t f = GetStateIndex(from), t = GetStateIndex(to);
+      if(f == NOSTATE || t == NOSTATE)
+	throw std::invalid_argument("RegisterTransition: unregistered state");
+      Table& tab = GetTable(evt);
+      tab.next[f] = t;
+      tab.movefrom.clear();
+      tab.moveto.clear();
+      for(size_t i=0; i<NSLOTS; ++i){
+	if(tab.next[i] != i){
+	  tab.movefrom.push_back(i);
+	  tab.moveto.push_back(tab.next[i]);
+	}
+      }
+      //the fallback machine needs it too, in case a handler shares the event;
+      //it reads the table, so registering `from` again just updates next[]
+      if(!tab.hasscratch[f]){
+	tab.hasscratch[f] = true;
+	_scratch.RegisterEventHandler(evt, EventHandler
+	  ([this, &tab, f](VState*, const Message&){ return _ids[tab.next[f]]; }),
+	  StateMachine::SEQ_DEFAULT, from);
+      }
+      return 0;
+    }
+
+    template<class From, class To> int RegisterTransition(const event_t& evt){
+      RegisterState<From>();
+      RegisterState<To>();
+      return RegisterTransition(evt, GetStateID<From>(), GetStateID<To>());
+    }
+
+    /** Register an arbitrary handler, as StateMachine::RegisterEventHandler.
+	Machines in `state` (or all states, for nullstate) then take the
+	slow path for `evt`.
+    */
+    template<class Handler>
+    int RegisterEventHandler(const event_t& evt, Handler handler,
+			     int sequence=StateMachine::SEQ_DEFAULT,
+			     const stateid_t& state=nullstate){
+      Table& tab = GetTable(evt);
+      if(state == nullstate){
+	tab.allslow = true;
+	tab.slow.assign(NSLOTS, true);
+	tab.slow[NOSTATE] = false;
+      }
+      else{
+	stateidx_t idx = GetStateIndex(state);
+	if(idx == NOSTATE)
+	  throw std::invalid_argument("RegisterEventHandler: unregistered state");
+	tab.slow[idx] = true;
+      }
+      tab.anyslow = true;
+      return _scratch.RegisterEventHandler(evt, handler, sequence, state);
+    }
+
+    template<class State, class Handler>
+    int RegisterEventHandler(const event_t& evt, Handler handler,
+			     int sequence=StateMachine::SEQ_DEFAULT){
+      RegisterState<State>();
+      return RegisterEventHandler(evt, handler, sequence, GetStateID<State>());
+    }
+
+    ///Put every machine into `initial`
+    void Start(const stateid_t& initial){
+      stateidx_t idx = GetStateIndex(initial);
+      if(idx == NOSTATE)
+	throw std::invalid_argument("Start: unregistered state");
+      std::fill(_state.begin(), _state.end(), idx);
+    }
+
+    ///Put one machine into `state` without running any handlers
+    void SetState(machineid_t id, const stateid_t& state)
+    { _state[id] = GetStateIndex(state); }
+
+    ///Apply `msg` to the machines listed in `ids`
+    void Apply(const Message& msg, const machineid_t* ids, size_t n){
+      auto it = _tables.find(msg.event);
+      if(it == _tables.end())
+	return;
+      const Table& tab = it->second;
+      const stateidx_t* next = tab.next;
+      stateidx_t* state = _state.data();
+      if(!tab.anyslow){
+	for(size_t i=0; i<n; ++i)
+	  state[ids[i]] = next[state[ids[i]]];
+	return;
+      }
+      for(size_t i=0; i<n; ++i){
+	machineid_t id = ids[i];
+	stateidx_t s = state[id];
+	if(tab.slow[s])
+	  SlowPath(id, msg);
+	else
+	  state[id] = next[s];
+      }
+    }
+
+    void Apply(const Message& msg, const std::vector<machineid_t>& ids)
+    { Apply(msg, ids.data(), ids.size()); }
+
+    ///Apply `msg` to every machine
+    void ApplyAll(const Message& msg){
+      auto it = _tables.find(msg.event);
+      if(it == _tables.end())
+	return;
+      const Table& tab = it->second;
+      const stateidx_t* next = tab.next;
+      stateidx_t* state = _state.data();
+      const size_t n = _state.size();
+      if(!tab.anyslow){
+	if(tab.movefrom.size() <= MAXBLEND)
+	  ApplyBlend(tab, state, n);
+	else{
+	  //byte-table gathers don't vectorize, but this is still branch-free
+	  for(size_t i=0; i<n; ++i)
+	    state[i] = next[state[i]];
+	}
+	return;
+      }
+      for(size_t i=0; i<n; ++i){
+	stateidx_t s = state[i];
+	if(tab.slow[s])
+	  SlowPath(i, msg);
+	else
+	  state[i] = next[s];
+      }
+    }
+
+    ///Dense index of a registered state, or NOSTATE
+    stateidx_t GetStateIndex(const stateid_t& id) const {
+      auto it = _index.find(id);
+      return it == _index.end() ? NOSTATE : it->second;
+    }
+
+    ///State ID for a dense index
+    stateid_t GetStateIDAt(stateidx_t idx) const
+    { return idx < _ids.size() ? _ids[idx] : nullstate; }
+
+    ///Current state index of one machine
+    stateidx_t GetStateIndexOf(machineid_t id) const { return _state[id]; }
+
+    ///Current state ID of one machine
+    stateid_t GetStateIDOf(machineid_t id) const
+    { return GetStateIDAt(_state[id]); }
+
+    ///Per-machine data
+    Data& GetData(machineid_t id) { return _data[id]; }
+    const Data& GetData(machineid_t id) const { return _data[id]; }
+
+    ///Raw arrays, for bulk processing by the caller
+    stateidx_t* GetStateArray() { return _state.data(); }
+    Data* GetDataArray() { return _data.data(); }
+
+    ///Number of machines in each state, indexed by dense state index
+    std::vector<size_t> CountByState() const {
+      std::vector<size_t> counts(_ids.size(), 0);
+      for(stateidx_t s : _state)
+	if(s != NOSTATE) ++counts[s];
+      return counts;
+    }
+
+  private:
+    //tables cover every possible index, so lookups need no bounds check
+    //and machines with NOSTATE map to themselves
+    static const size_t NSLOTS = 256;
+    struct Table{
+      stateidx_t next[NSLOTS];
+      std::vector<char> slow;  ///< char, not bool, to avoid bit packing
+      std::vector<char> hasscratch; ///< from-states with a _scratch handler
+      bool anyslow = false;
+      bool allslow = false;
+      //states that next[] doesn't map to themselves, for ApplyBlend
+      std::vector<stateidx_t> movefrom, moveto;
+    };
+
+    //beyond this many moving states, one pass per state costs more than
+    //the scalar lookup
+    static const size_t MAXBLEND = 8;
+    static const size_t BLOCK = 256;
+
+    /** Apply `tab` by comparing each state against every moving state and
+	blending in its target. Works on fixed-size local blocks so the
+	inner loop has a constant trip count and no aliasing, and vectorizes.
+    */
+    static void ApplyBlend(const Table& tab, stateidx_t* state, size_t n){
+      const size_t nmoves = tab.movefrom.size();
+      const stateidx_t* from = tab.movefrom.data();
+      const stateidx_t* to = tab.moveto.data();
+      size_t b = 0;
+      for(; b + BLOCK <= n; b += BLOCK){
+	stateidx_t in[BLOCK], out[BLOCK];
+	memcpy(in, state + b, BLOCK);
+	memcpy(out, in, BLOCK);
+	for(size_t k=0; k<nmoves; ++k){
+	  const stateidx_t f = from[k], t = to[k];
+	  for(size_t j=0; j<BLOCK; ++j)
+	    out[j] = in[j] == f ? t : out[j];
+	}
+	memcpy(state + b, out, BLOCK);
+      }
+      for(; b<n; ++b)
+	state[b] = tab.next[state[b]];
+    }
+
+    Table& GetTable(const event_t& evt){
+      auto it = _tables.find(evt);
+      if(it != _tables.end())
+	return it->second;
+      Table& tab = _tables[evt];
+      for(size_t i=0; i<NSLOTS; ++i)
+	tab.next[i] = i;
+      tab.slow.assign(NSLOTS, false);
+      tab.hasscratch.assign(NSLOTS, false);
+      return tab;
+    }
+
+    void SlowPath(machineid_t id, const Message& msg){
+      _scratch._id = id;
+      _scratch.Start(_ids[_state[id]]);
+      _scratch.Handle(msg);
+      stateidx_t next = GetStateIndex(_scratch.GetCurrentStateID());
+      if(next != NOSTATE)
+	_state[id] = next;
+    }
+
+    std::vector<stateidx_t> _state;
+    std::vector<Data> _data;
+    std::vector<stateid_t> _ids;
+    std::map<stateid_t, stateidx_t> _index;
+    std::unordered_map<event_t, Table> _tables;
+    Machine _scratch;
+  };
+
+  template<class Data> const typename Population<Data>::stateidx_t
+  Population<Data>::NOSTATE;
+  template<class Data> const size_t Population<Data>::NSLOTS;
+  template<class Data> const size_t Population<Data>::MAXBLEND;
+  template<class Data> const size_t Population<Data>::BLOCK;
+};
+
+#endif
@@ -0,0 +1,438 @@
+#include "ShmTransport.hh"
+#include "StateMachine.hh"
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+
+using namespace fsm;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+	      "shm transport needs address-free atomics");
+
+namespace fsm{
+  static const int MAX_PRODUCERS = 64;
+
+  ///Layout at the start of the shared segment. Written once by the consumer,
+  ///then only touched through atomics.
+  struct ShmHeader{
+    uint32_t magic;
+    uint32_t multiproducer;
+    uint64_t capacity;
+    //producer-owned line
+    alignas(64) std::atomic<uint64_t> head;
+    std::atomic<uint32_t> data_seq;      ///< futex word, bumped on publish
+    std::atomic<uint32_t> producer_sleeping;
+    std::atomic<int32_t>  writelock;     ///< pid of the writer, 0 if free
+    std::atomic<uint32_t> lock_seq;      ///< futex word, bumped on unlock
+    std::atomic<uint32_t> lock_waiters;  ///< producers asleep on lock_seq
+    //consumer-owned line
+    alignas(64) std::atomic<uint64_t> tail;
+    std::atomic<uint32_t> space_seq;     ///< futex word, bumped on release
+    std::atomic<uint32_t> consumer_sleeping;
+    std::atomic<int32_t>  consumer_pid;
+    //attach/detach only
+    alignas(64) std::atomic<uint32_t> everattached;
+    std::atomic<int32_t>  producers[MAX_PRODUCERS]; ///< pid per slot, 0 if free
+  };
+};
+
+namespace {
+  const uint32_t SHM_MAGIC = 0x46534d33; // "FSM3"
+  const uint16_t REC_WRAP = 1;
+  const size_t REC_ALIGN = 16;
+
+  ///Each entry is a header, the payload (aligned), then the event label
+  struct RecordHeader{
+    uint32_t size;     ///< total bytes including padding
+    uint16_t flags;
+    uint16_t evtsize;
+    uint32_t datasize;
+    uint32_t reserved;
+  };
+  static_assert(sizeof(RecordHeader) == REC_ALIGN, "bad record header size");
+
+  inline size_t align_up(size_t n){ return (n + REC_ALIGN-1) & ~(REC_ALIGN-1); }
+
+  inline bool pid_alive(int32_t pid){
+    return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+  }
+
+  using steady = std::chrono::steady_clock;
+
+  ///Wait on a futex word for at most `ms` milliseconds
+  void futex_wait(std::atomic<uint32_t>* word, uint32_t val, int ms){
+    timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT,
+	    val, &ts, nullptr, 0);
+  }
+
+  void futex_wake(std::atomic<uint32_t>* word, int n=INT_MAX){
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE,
+	    n, nullptr, nullptr, 0);
+  }
+
+  ///Sleep in slices so we can notice a dead peer
+  template<class Ready, class Alive>
+  int block_until(std::atomic<uint32_t>* seq, std::atomic<uint32_t>* sleeping,
+		  int timeout_ms, Ready ready, Alive alive){
+    static const int SLICE_MS = 100;
+    auto deadline = steady::now() + std::chrono::milliseconds(timeout_ms);
+    while(!ready()){
+      if(!alive())
+	return shm::SHM_PEER_DEAD;
+      int wait = SLICE_MS;
+      if(timeout_ms >= 0){
+	auto left = std::chrono::duration_cast<std::chrono::milliseconds>
+	  (deadline - steady::now()).count();
+	if(left <= 0)
+	  return shm::SHM_TIMEOUT;
+	if(left < wait) wait = left;
+      }
+      uint32_t s = seq->load();
+      sleeping->store(1);
+      if(!ready())
+	futex_wait(seq, s, wait);
+      sleeping->store(0);
+    }
+    return shm::SHM_OK;
+  }
+};
+
+/**** ShmSegment ****/
+
+void ShmSegment::Map(int fd, size_t totalsize)
+{
+  void* addr = mmap(nullptr, totalsize, PROT_READ|PROT_WRITE, MAP_SHARED,fd,0);
+  close(fd);
+  if(addr == MAP_FAILED)
+    throw std::runtime_error("Unable to map shm segment "+_name+": "
+			     +strerror(errno));
+  _mapsize = totalsize;
+  _hdr = static_cast<ShmHeader*>(addr);
+  _ring = static_cast<char*>(addr) + align_up(sizeof(ShmHeader));
+}
+
+ShmSegment::~ShmSegment()
+{
+  if(_hdr)
+    munmap(_hdr, _mapsize);
+}
+
+size_t ShmSegment::GetCapacity() const { return _hdr->capacity; }
+
+size_t ShmSegment::GetUsed() const
+{ return _hdr->head.load() - _hdr->tail.load(); }
+
+/**** ShmProducer ****/
+
+ShmProducer::ShmProducer(const std::string& name) : ShmSegment(name)
+{
+  int fd = shm_open(name.c_str(), O_RDWR, 0);
+  if(fd < 0)
+    throw std::runtime_error("Unable to open shm segment "+name+": "
+			     +strerror(errno));
+  struct stat st;
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ShmHeader)){
+    close(fd);
+    throw std::runtime_error("shm segment "+name+" is not initialized");
+  }
+  Map(fd, st.st_size);
+  if(_hdr->magic != SHM_MAGIC)
+    throw std::runtime_error("shm segment "+name+" has bad magic number");
+  //claim a slot; one left by a crashed producer can be reused
+  const int32_t me = getpid();
+  for(int i=0; i<MAX_PRODUCERS && _slot<0; ++i){
+    int32_t pid = _hdr->producers[i].load();
+    if((pid == 0 || !pid_alive(pid)) &&
+       _hdr->producers[i].compare_exchange_strong(pid, me))
+      _slot = i;
+  }
+  if(_slot < 0)
+    throw std::runtime_error("shm segment "+name+" has too many producers");
+  //without the write lock, a second producer would corrupt the ring
+  if(!_hdr->multiproducer){
+    for(int i=0; i<MAX_PRODUCERS; ++i){
+      if(i != _slot && pid_alive(_hdr->producers[i].load())){
+	_hdr->producers[_slot].store(0);
+	_slot = -1;
+	throw std::runtime_error("shm segment "+name+" is single-producer and "
+				 "already has a producer");
+      }
+    }
+  }
+  _hdr->everattached.store(1);
+}
+
+ShmProducer::~ShmProducer()
+{
+  if(_hdr && _slot >= 0){
+    _hdr->producers[_slot].store(0);
+    //make sure a sleeping consumer notices if we were the last one
+    ++_hdr->data_seq;
+    futex_wake(&_hdr->data_seq);
+  }
+}
+
+bool ShmProducer::PeerAlive() const
+{ return pid_alive(_hdr->consumer_pid.load()); }
+
+bool ShmProducer::Lock(int timeout_ms)
+{
+  if(!_hdr->multiproducer)
+    return true;
+  static const int SLICE_MS = 100;
+  const int32_t me = getpid();
+  int32_t holder = 0;
+  //the lock is only held for a memcpy, so a short spin usually gets it
+  for(int spin=0; spin<64; ++spin){
+    holder = 0;
+    if(_hdr->writelock.compare_exchange_weak(holder, me))
+      return true;
+  }
+  auto deadline = steady::now() + std::chrono::milliseconds(timeout_ms);
+  uint32_t last = _hdr->lock_seq.load() - 1;
+  while(true){
+    uint32_t s = _hdr->lock_seq.load();
+    //register as a waiter before the last try, so an Unlock that misses
+    //us has already freed the lock by then
+    ++_hdr->lock_waiters;
+    holder = 0;
+    if(_hdr->writelock.compare_exchange_strong(holder, me)){
+      --_hdr->lock_waiters;
+      return true;
+    }
+    //a producer that died holding the lock never published its entry,
+    //so it's safe to take over; only worth probing once it has held the
+    //lock through a whole slice
+    if(s == last && !pid_alive(holder) &&
+       _hdr->writelock.compare_exchange_strong(holder, me)){
+      --_hdr->lock_waiters;
+      return true;
+    }
+    int wait = SLICE_MS;
+    if(timeout_ms >= 0){
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>
+	(deadline - steady::now()).count();
+      if(left <= 0){
+	--_hdr->lock_waiters;
+	return false;
+      }
+      if(left < wait) wait = left;
+    }
+    futex_wait(&_hdr->lock_seq, s, wait);
+    --_hdr->lock_waiters;
+    last = s;
+  }
+}
+
+void ShmProducer::Unlock()
+{
+  if(!_hdr->multiproducer)
+    return;
+  _hdr->writelock.store(0);
+  ++_hdr->lock_seq;
+  if(_hdr->lock_waiters.load())
+    futex_wake(&_hdr->lock_seq, 1);
+}
+
+int ShmProducer::Post(const event_t& evt, const void* data, size_t datasize,
+		      int timeout_ms)
+{
+  const uint64_t cap = _hdr->capacity;
+  const size_t recsize = align_up(sizeof(RecordHeader) + datasize)
+    + align_up(evt.size());
+  if(recsize > cap/2 || evt.size() > UINT16_MAX)
+    return shm::SHM_TOO_LARGE;
+  //a clean shutdown clears consumer_pid; a crash is noticed by the kill()
+  //probe, done every so often here and whenever the ring is full
+  if(_hdr->consumer_pid.load(std::memory_order_relaxed) == 0 ||
+     ((++_nposts & 0x3ff) == 0 && !PeerAlive()))
+    return shm::SHM_PEER_DEAD;
+  if(!Lock(timeout_ms))
+    return shm::SHM_TIMEOUT;
+
+  uint64_t head = _hdr->head.load(std::memory_order_relaxed);
+  size_t contig = cap - (head & (cap-1));
+  size_t needed = recsize + (contig < recsize ? contig : 0);
+  auto fits = [&]{
+    return head + needed - _hdr->tail.load(std::memory_order_acquire) <= cap;
+  };
+  if(!fits()){
+    auto alive = [this]{ return PeerAlive(); };
+    int err = block_until(&_hdr->space_seq, &_hdr->producer_sleeping,
+			  timeout_ms, fits, alive);
+    if(err != shm::SHM_OK){
+      Unlock();
+      return err;
+    }
+  }
+
+  if(contig < recsize){
+    //not enough room before the end; skip to the start of the ring
+    RecordHeader* pad = reinterpret_cast<RecordHeader*>(_ring+(head&(cap-1)));
+    pad->size = contig;
+    pad->flags = REC_WRAP;
+    head += contig;
+  }
+  char* at = _ring + (head & (cap-1));
+  RecordHeader* rec = reinterpret_cast<RecordHeader*>(at);
+  rec->size = recsize;
+  rec->flags = 0;
+  rec->evtsize = evt.size();
+  rec->datasize = datasize;
+  char* payload = at + sizeof(RecordHeader);
+  if(datasize)
+    memcpy(payload, data, datasize);
+  memcpy(payload + align_up(datasize), evt.data(), evt.size());
+
+  //publish
+  _hdr->head.store(head + recsize, std::memory_order_release);
+  Unlock();
+  ++_hdr->data_seq;
+  if(_hdr->consumer_sleeping.load())
+    futex_wake(&_hdr->data_seq);
+  return shm::SHM_OK;
+}
+
+int ShmProducer::Post(const Message& msg, int timeout_ms)
+{
+  return Post(msg.event, msg.GetData(), msg.GetDataSize(), timeout_ms);
+}
+
+/**** ShmConsumer ****/
+
+ShmConsumer::ShmConsumer(const std::string& name, size_t capacity,
+			 bool multiproducer) : ShmSegment(name)
+{
+  size_t cap = 4096;
+  while(cap < capacity) cap <<= 1;
+
+  //a previous consumer may have crashed without cleaning up, but don't
+  //pull the segment out from under one that is still running
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if(fd >= 0){
+    struct stat st;
+    bool live = false;
+    if(fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ShmHeader)){
+      void* addr = mmap(nullptr, sizeof(ShmHeader), PROT_READ, MAP_SHARED,
+			fd, 0);
+      if(addr != MAP_FAILED){
+	const ShmHeader* old = static_cast<const ShmHeader*>(addr);
+	live = old->magic == SHM_MAGIC && pid_alive(old->consumer_pid.load());
+	munmap(addr, sizeof(ShmHeader));
+      }
+    }
+    close(fd);
+    if(live)
+      throw std::runtime_error("shm segment "+name+" is in use by another "
+			       "consumer");
+    shm_unlink(name.c_str());
+  }
+  fd = shm_open(name.c_str(), O_RDWR|O_CREAT|O_EXCL, 0600);
+  if(fd < 0)
+    throw std::runtime_error("Unable to create shm segment "+name+": "
+			     +strerror(errno));
+  size_t total = align_up(sizeof(ShmHeader)) + cap;
+  if(ftruncate(fd, total) != 0){
+    close(fd);
+    shm_unlink(name.c_str());
+    throw std::runtime_error("Unable to size shm segment "+name+": "
+			     +strerror(errno));
+  }
+  Map(fd, total);
+  //ftruncate zero-fills, which is a valid initial state for all atomics
+  _hdr->capacity = cap;
+  _hdr->multiproducer = multiproducer;
+  _hdr->consumer_pid.store(getpid());
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  _hdr->magic = SHM_MAGIC;
+}
+
+ShmConsumer::~ShmConsumer()
+{
+  if(_hdr){
+    _hdr->consumer_pid.store(0);
+    ++_hdr->space_seq;
+    futex_wake(&_hdr->space_seq);
+  }
+  shm_unlink(_name.c_str());
+}
+
+bool ShmConsumer::PeerAlive() const
+{
+  if(!_hdr->everattached.load()) //nobody has attached yet; keep waiting
+    return true;
+  //slots of producers that crashed still hold their pid
+  for(int i=0; i<MAX_PRODUCERS; ++i)
+    if(pid_alive(_hdr->producers[i].load()))
+      return true;
+  return false;
+}
+
+size_t ShmConsumer::Poll(StateMachine& sm, size_t maxevents)
+{
+  return Consume(maxevents, [&sm](Message& msg){ sm.Handle(msg); });
+}
+
+size_t ShmConsumer::PostTo(StateMachine& sm, size_t maxevents)
+{
+  return Consume(maxevents, [&sm](Message& msg){
+      //the ring space is reused as soon as we return
+      sm.Post(Message(msg.event, msg.GetData(), msg.GetDataSize(), true));
+    });
+}
+
+template<class Deliver>
+size_t ShmConsumer::Consume(size_t maxevents, Deliver deliver)
+{
+  const uint64_t cap = _hdr->capacity;
+  uint64_t tail = _hdr->tail.load(std::memory_order_relaxed);
+  uint64_t head = _hdr->head.load(std::memory_order_acquire);
+  size_t nhandled = 0;
+  while(nhandled < maxevents){
+    if(tail == head){
+      head = _hdr->head.load(std::memory_order_acquire);
+      if(tail == head)
+	break;
+    }
+    char* at = _ring + (tail & (cap-1));
+    const RecordHeader* rec = reinterpret_cast<const RecordHeader*>(at);
+    if(!(rec->flags & REC_WRAP)){
+      char* payload = at + sizeof(RecordHeader);
+      Message msg(event_t(payload + align_up(rec->datasize), rec->evtsize),
+		  rec->datasize ? payload : nullptr, rec->datasize);
+      deliver(msg);
+      ++nhandled;
+    }
+    tail += rec->size;
+    //entry is no longer referenced; hand the space back
+    _hdr->tail.store(tail, std::memory_order_release);
+    ++_hdr->space_seq;
+    if(_hdr->producer_sleeping.load())
+      futex_wake(&_hdr->space_seq);
+  }
+  return nhandled;
+}
+
+int ShmConsumer::Wait(int timeout_ms)
+{
+  auto ready = [this]{
+    return _hdr->head.load(std::memory_order_acquire) !=
+      _hdr->tail.load(std::memory_order_relaxed);
+  };
+  auto alive = [this]{ return PeerAlive(); };
+  return block_until(&_hdr->data_seq, &_hdr->consumer_sleeping, timeout_ms,
+		     ready, alive);
+}
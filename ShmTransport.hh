@@ -0,0 +1,140 @@
+#ifndef SHMTRANSPORT_h
+#define SHMTRANSPORT_h
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include "define.hh"
+
+namespace fsm{
+  class StateMachine;
+  class Message;
+  struct ShmHeader;
+
+  /** Shared-memory ring buffer used to post events to a StateMachine living
+      in another process on the same host.
+
+      The consumer side owns the POSIX shm segment; producers attach to it by
+      name. Each entry holds an event label plus an opaque payload. Entries are
+      handed to StateMachine::Handle as Messages pointing directly into the
+      shared segment, so the payload is only valid for the duration of the
+      Handle call; handlers must copy anything they want to keep.
+  */
+  namespace shm{
+    enum STATUSCODE {
+      SHM_OK        =  0,
+      SHM_TIMEOUT   = -1, ///< no data (consumer) or no space (producer) yet
+      SHM_PEER_DEAD = -2, ///< other side exited or crashed
+      SHM_TOO_LARGE = -3, ///< entry can never fit in the ring
+    };
+  };
+
+  ///Process-side handle to the mapped segment; common to both ends
+  class ShmSegment{
+  public:
+    ///Name of the shm object (as passed to shm_open)
+    const std::string& GetName() const { return _name; }
+
+    ///Size of the ring data area in bytes
+    size_t GetCapacity() const;
+
+    ///Number of bytes currently queued (approximate from other processes)
+    size_t GetUsed() const;
+
+  protected:
+    ShmSegment(const std::string& name) : _name(name) {}
+    ~ShmSegment();
+    ShmSegment(const ShmSegment&) = delete;
+    ShmSegment& operator=(const ShmSegment&) = delete;
+
+    void Map(int fd, size_t totalsize);
+
+    std::string _name;
+    ShmHeader* _hdr = nullptr;
+    char* _ring = nullptr;
+    size_t _mapsize = 0;
+  };
+
+  /** Writing end of the transport. Up to 64 may attach to a consumer
+      created with multiproducer=true; otherwise only one at a time.
+  */
+  class ShmProducer : public ShmSegment{
+  public:
+    /** Attach to a segment previously created by a ShmConsumer. Throws
+	std::runtime_error if the segment is single-producer and another
+	live producer is attached, or if all producer slots are taken.
+    */
+    ShmProducer(const std::string& name);
+
+    ///Detach; tells the consumer we are gone
+    ~ShmProducer();
+
+    /** Copy an event and payload into the ring.
+	@param timeout_ms  how long to wait for space if the ring is full;
+	                   <0 waits forever, 0 never blocks
+	@returns shm::SHM_OK or one of the error codes in shm::STATUSCODE;
+	SHM_PEER_DEAD as soon as the consumer has shut down, or within about
+	a thousand posts if it crashed
+    */
+    int Post(const event_t& evt, const void* data=nullptr, size_t datasize=0,
+	     int timeout_ms=-1);
+
+    ///Post an existing message, copying its payload
+    int Post(const Message& msg, int timeout_ms=-1);
+
+    ///Is the consumer still attached?
+    bool PeerAlive() const;
+
+  private:
+    bool Lock(int timeout_ms);
+    void Unlock();
+
+    int _slot = -1; ///< our entry in the segment's producer table
+    unsigned _nposts = 0;
+  };
+
+  ///Reading end of the transport; creates and owns the shm segment
+  class ShmConsumer : public ShmSegment{
+  public:
+    /** Create a new segment. A stale segment with the same name is removed;
+	throws std::runtime_error if its consumer is still running.
+	@param name           shm object name, e.g. "/myapp-events"
+	@param capacity       ring size in bytes; rounded up to a power of 2
+	@param multiproducer  if false, only one producer may be attached at a
+	                      time and no lock is taken on the write path
+    */
+    ShmConsumer(const std::string& name, size_t capacity=1<<20,
+		bool multiproducer=false);
+
+    ///Unmap and unlink the segment
+    ~ShmConsumer();
+
+    /** Dispatch up to `maxevents` queued entries to `sm` without blocking.
+	@returns the number of entries handled
+    */
+    size_t Poll(StateMachine& sm, size_t maxevents=SIZE_MAX);
+
+    /** Post copies of up to `maxevents` queued entries to `sm` without
+	dispatching them; a later sm.ProcessQueue() handles the whole batch,
+	so the machine's coalescing policies apply across the backlog.
+	Costs a copy of each payload, which Poll avoids.
+	@returns the number of entries posted
+    */
+    size_t PostTo(StateMachine& sm, size_t maxevents=SIZE_MAX);
+
+    /** Block until at least one entry is queued.
+	@returns shm::SHM_OK, SHM_TIMEOUT, or SHM_PEER_DEAD if the ring is
+	empty and no live producer remains
+    */
+    int Wait(int timeout_ms=-1);
+
+    ///Is at least one producer attached and alive?
+    bool PeerAlive() const;
+
+  private:
+    ///Pass each queued entry to `deliver`, then release its space
+    template<class Deliver> size_t Consume(size_t maxevents, Deliver deliver);
+  };
+};
+
+#endif
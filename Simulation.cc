@@ -0,0 +1,109 @@
+#include "Simulation.hh"
+#include "StateMachine.hh"
+#include <iomanip>
+
+using namespace fsm;
+
+Simulation::Simulation(mstick_t start) :
+  _clock(std::make_shared<VirtualClock>(start)), _previous(GetClock())
+{
+  SetClock(_clock);
+}
+
+Simulation::~Simulation()
+{
+  SetClock(_previous);
+}
+
+void Simulation::Schedule(mstick_t when, StateMachine* sm, const Message& msg)
+{
+  _machines.insert(sm);
+  _queue.push(Event{when, _nscheduled++, sm, msg});
+}
+
+Simulation::StateStats& Simulation::GetStats(stateid_t id,
+					     const std::string& name)
+{
+  StateStats& stats = _statestats[id];
+  if(stats.name.empty())
+    stats.name = name;
+  return stats;
+}
+
+void Simulation::OnTransition(StateMachine& sm, stateid_t fromid,
+			      mstick_t entered)
+{
+  if(fromid != nullstate){
+    StateStats& from = GetStats(fromid, sm.GetPreviousStateName());
+    ++from.nexited;
+    from.dwell += _clock->Now() - entered;
+  }
+  stateid_t toid = sm.GetCurrentStateID();
+  if(sm.GetCurrentState())
+    ++GetStats(toid, sm.GetCurrentStateName()).nentered;
+  ++_transitions[std::make_pair(fromid, toid)];
+  if(_outer)
+    _outer->OnTransition(sm, fromid, entered);
+}
+
+size_t Simulation::Run(mstick_t until, size_t maxevents)
+{
+  size_t nrun = 0;
+  while(!_queue.empty() && nrun < maxevents && _queue.top().time <= until){
+    //pop first; the handler may schedule more events
+    Event evt = std::move(const_cast<Event&>(_queue.top()));
+    _queue.pop();
+    if(evt.time > _clock->Now())
+      _clock->Set(evt.time);
+
+    StateMachine* sm = evt.sm;
+    if(sm->GetCurrentState()) //list it in the report even if it never moves
+      GetStats(sm->GetCurrentStateID(), sm->GetCurrentStateName());
+    _outer = sm->GetTransitionObserver();
+    sm->SetTransitionObserver(this);
+    try{
+      sm->Handle(evt.msg);
+    }
+    catch(...){
+      sm->SetTransitionObserver(_outer);
+      throw;
+    }
+    sm->SetTransitionObserver(_outer);
+    ++nrun;
+  }
+  _ndispatched += nrun;
+  return nrun;
+}
+
+void Simulation::Report(std::ostream& out)
+{
+  //include time spent by machines that haven't left their state yet
+  std::map<stateid_t, mstick_t> open;
+  for(StateMachine* sm : _machines){
+    const VState* st = sm->GetCurrentState();
+    if(st)
+      open[sm->GetCurrentStateID()] += Now() - st->GetTimeEntered();
+  }
+  out<<"Simulated "<<_ndispatched<<" events on "<<_machines.size()
+     <<" machines; clock at "<<Now()<<" ms\n";
+  out<<std::left<<std::setw(24)<<"state"<<std::right<<std::setw(12)
+     <<"entered"<<std::setw(12)<<"exited"<<std::setw(16)<<"dwell (ms)"
+     <<std::setw(14)<<"mean (ms)"<<'\n';
+  for(auto& entry : _statestats){
+    const StateStats& st = entry.second;
+    mstick_t dwell = st.dwell + open[entry.first];
+    out<<std::left<<std::setw(24)<<st.name<<std::right<<std::setw(12)
+       <<st.nentered<<std::setw(12)<<st.nexited<<std::setw(16)<<dwell
+       <<std::setw(14)<<(st.nexited ? st.dwell/double(st.nexited) : 0.)
+       <<'\n';
+  }
+  out<<"transitions:\n";
+  for(auto& entry : _transitions){
+    auto name = [this](stateid_t id){
+      auto it = _statestats.find(id);
+      return it == _statestats.end() ? std::string("(none)") : it->second.name;
+    };
+    out<<"  "<<name(entry.first.first)<<" -> "<<name(entry.first.second)
+       <<": "<<entry.second<<'\n';
+  }
+}
@@ -0,0 +1,109 @@
+#ifndef SIMULATION_h
+#define SIMULATION_h
+
+#include <vector>
+#include <queue>
+#include <map>
+#include <unordered_set>
+#include <memory>
+#include <limits>
+#include <iostream>
+#include "define.hh"
+#include "Clock.hh"
+#include "Message.hh"
+#include "StateMachine.hh"
+
+namespace fsm{
+
+  /** Single-threaded discrete-event driver for any number of StateMachines.
+      While alive it installs a VirtualClock as the library clock, so state
+      entry times and logs follow simulated time. Events are kept in one
+      queue ordered by timestamp (ties in scheduling order); Run jumps the
+      clock straight to each event's time and dispatches it.
+
+      While Run dispatches an event, the receiving machine reports each of
+      its transitions to the Simulation, so states passed through by raised
+      events are counted too. Transitions made outside Run, such as Start
+      or a Handle call on another machine from inside a handler, are not.
+  */
+  class Simulation : private TransitionObserver{
+  public:
+    ///Install a virtual clock starting at `start` ms
+    Simulation(mstick_t start=0);
+
+    ///Restore the clock that was active before
+    ~Simulation();
+
+    Simulation(const Simulation&) = delete;
+    Simulation& operator=(const Simulation&) = delete;
+
+    ///Current simulated time
+    mstick_t Now() const { return _clock->Now(); }
+
+    ///Queue `msg` for `sm` at absolute time `when`. The message is copied;
+    ///any payload it points to but doesn't own must outlive the event
+    void Schedule(mstick_t when, StateMachine* sm, const Message& msg);
+
+    ///Queue `msg` for `sm` after `delay` ms of simulated time
+    void ScheduleIn(mstick_t delay, StateMachine* sm, const Message& msg)
+    { Schedule(Now() + delay, sm, msg); }
+
+    /** Dispatch events in time order until the queue is empty, the next
+	event is after `until`, or `maxevents` have been handled.
+	@returns the number of events dispatched
+    */
+    size_t Run(mstick_t until=std::numeric_limits<mstick_t>::max(),
+	       size_t maxevents=std::numeric_limits<size_t>::max());
+
+    ///Number of events waiting
+    size_t GetNPending() const { return _queue.size(); }
+
+    ///Total events dispatched so far
+    size_t GetNDispatched() const { return _ndispatched; }
+
+    struct StateStats{
+      std::string name;
+      size_t nentered = 0;
+      size_t nexited = 0;
+      mstick_t dwell = 0;  ///< total ms spent by machines that have left
+    };
+    ///Per-state counts and dwell times observed so far
+    const std::map<stateid_t, StateStats>& GetStateStats() const
+    { return _statestats; }
+
+    ///Number of observed transitions for each (from, to) pair
+    const std::map<std::pair<stateid_t,stateid_t>, size_t>&
+    GetTransitionCounts() const { return _transitions; }
+
+    ///Print state dwell and transition statistics. Dwell of machines still
+    ///in a state is included up to the current time.
+    void Report(std::ostream& out=std::cout);
+
+  private:
+    struct Event{
+      mstick_t time;
+      uint64_t order;
+      StateMachine* sm;
+      Message msg;
+      bool operator>(const Event& right) const
+      { return time != right.time ? time > right.time : order > right.order; }
+    };
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event> > _queue;
+    uint64_t _nscheduled = 0;
+    size_t _ndispatched = 0;
+
+    std::shared_ptr<VirtualClock> _clock;
+    std::shared_ptr<Clock> _previous;
+
+    std::unordered_set<StateMachine*> _machines;
+    std::map<stateid_t, StateStats> _statestats;
+    std::map<std::pair<stateid_t,stateid_t>, size_t> _transitions;
+    StateStats& GetStats(stateid_t id, const std::string& name);
+
+    ///Observer the dispatched machine had before Run; still notified
+    TransitionObserver* _outer = nullptr;
+    void OnTransition(StateMachine& sm, stateid_t fromid, mstick_t entered);
+  };
+};
+
+#endif
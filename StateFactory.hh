@@ -5,6 +5,7 @@
 namespace fsm{
   struct VStateFactory{
     std::string name;
+    int index = -1; ///< dense registration index, for tracepoints
     virtual VState* enter(StateMachine* sm) = 0;
     VStateFactory(const std::string& statename) : name(statename) {}
     inline VState* operator()(StateMachine* sm){ return enter(sm); }
@@ -1,5 +1,7 @@
 #include "StateMachine.hh"
-#include <iostream>
+#include "Logger.hh"
+#include "ThreadPool.hh"
+#include "Trace.hh"
 #include <cassert>
 
 using namespace fsm;
@@ -7,6 +9,20 @@ using namespace fsm;
 //static initializers
 const stateid_t nullstate = GetStateID(nullptr); //this *should* be in State.cc
 const event_t StateMachine::ERROR_DEFAULT = "fsm::StateMachine::ERROR_DEFAULT";
+const size_t StateMachine::MAXRESOLVED;
+
+#ifdef FSM_ENABLE_USDT
+//probe semaphores; tracers increment these while attached, see Trace.hh
+#define FSM_SEMAPHORE(name) unsigned short fsm_##name##_semaphore \
+  __attribute__((section(".probes"))) = 0
+extern "C" {
+  FSM_SEMAPHORE(handle__begin);
+  FSM_SEMAPHORE(handle__end);
+  FSM_SEMAPHORE(handler__begin);
+  FSM_SEMAPHORE(handler__end);
+  FSM_SEMAPHORE(transition);
+}
+#endif
 
 //constructor
 StateMachine::StateMachine() : 
@@ -21,35 +37,350 @@ StateMachine::~StateMachine()
 }
 
 status_t StateMachine::Handle(const Message& msg)
+{
+  if(_dispatching){
+    //called from inside a handler; run now, but leave status and the
+    //pending queue to the outer call
+    Dispatch(msg);
+    return status;
+  }
+  return RunToCompletion(&msg);
+}
+
+status_t StateMachine::ProcessQueue()
+{
+  if(_dispatching) //the outer Handle will get to it
+    return status;
+  return RunToCompletion(nullptr);
+}
+
+status_t StateMachine::RunToCompletion(const Message* msg)
 {
   status = STATUS_OK; // do we really want to do this?
-  stateid_t currentid = GetCurrentStateID();
-  auto it = _eventhandlers.find(msg.event);
-  if(it == _eventhandlers.end()){
+  _dispatching = true;
+  try{
+    //take what was posted before this call; anything posted from here on,
+    //by handlers or other threads, waits for the next one
+    if(_haveposted.load(std::memory_order_acquire)){
+      std::lock_guard<std::mutex> lock(_postmutex);
+      _posted.swap(_draining);
+      _postbarrier = 0;
+      ++_postgen;
+      _haveposted.store(false, std::memory_order_relaxed);
+    }
+    //posted events go first
+    for(const Message& queued : _draining){
+      Dispatch(queued);
+      DrainRaised();
+    }
+    _draining.clear();
+    if(msg){
+      Dispatch(*msg);
+      DrainRaised();
+    }
+  }
+  catch(...){
+    _dispatching = false;
+    _draining.clear();
+    ClearRaised();
+    throw;
+  }
+  _dispatching = false;
+  return status;
+}
+
+status_t StateMachine::Raise(const Message& msg)
+{
+  return Raise(Message(msg));
+}
+
+status_t StateMachine::Raise(Message&& msg)
+{
+  assert(!_inparallel && "Raise called from a parallel handler");
+  if(!_dispatching)
+    return Handle(msg);
+  _raised.push_back(std::move(msg));
+  return status;
+}
+
+void StateMachine::Post(const Message& msg)
+{
+  Post(Message(msg));
+}
+
+void StateMachine::Post(Message&& msg)
+{
+  std::lock_guard<std::mutex> lock(_postmutex);
+  Enqueue(std::move(msg));
+  _haveposted.store(true, std::memory_order_relaxed);
+}
+
+void StateMachine::SetCoalescePolicy(const event_t& evt, COALESCEPOLICY policy,
+				     MergeFunc merge)
+{
+  if(policy == COALESCE_MERGE && !merge)
+    throw std::invalid_argument("COALESCE_MERGE requires a merge function");
+  std::lock_guard<std::mutex> lock(_postmutex);
+  coalesceinfo& info = _coalesce[evt];
+  info.policy = policy;
+  info.merge = merge;
+}
+
+StateMachine::CoalesceStats 
+StateMachine::GetCoalesceStats(const event_t& evt) const
+{
+  std::lock_guard<std::mutex> lock(_postmutex);
+  auto it = _coalesce.find(evt);
+  return it == _coalesce.end() ? CoalesceStats() : it->second.stats;
+}
+
+void StateMachine::Enqueue(Message&& msg)
+{
+  if(!_coalesce.empty()){
+    auto it = _coalesce.find(msg.event);
+    if(it != _coalesce.end() && it->second.policy != COALESCE_NONE){
+      coalesceinfo& info = it->second;
+      //only fold into a copy that's still waiting and that no
+      //non-coalescable event has been queued behind
+      if(info.generation == _postgen && info.slot >= _postbarrier){
+	Message& queued = _posted[info.slot];
+	unsigned count = queued.count + msg.count;
+	switch(info.policy){
+	case COALESCE_KEEP_LATEST:
+	  queued = std::move(msg);
+	  ++info.stats.ndropped;
+	  break;
+	case COALESCE_KEEP_FIRST:
+	  ++info.stats.ndropped;
+	  break;
+	case COALESCE_MERGE:
+	  info.merge(queued, msg);
+	  break;
+	default:
+	  break;
+	}
+	queued.count = count;
+	++info.stats.ncoalesced;
+	return;
+      }
+      info.slot = _posted.size();
+      info.generation = _postgen;
+      _posted.push_back(std::move(msg));
+      return;
+    }
+  }
+  _posted.push_back(std::move(msg));
+  _postbarrier = _posted.size();
+}
+
+void StateMachine::DrainRaised()
+{
+  size_t ndrained = 0;
+  while(_raisedhead < _raised.size()){
+    if(++ndrained > _maxraised){
+      std::stringstream err;
+      err<<"Handlers raised more than "<<_maxraised<<" events while handling "
+	 <<"one event; dropping "<<_raised.size() - _raisedhead
+	 <<" still queued";
+      ProduceError(RAISE_LIMIT_EXCEEDED, err.str());
+      break;
+    }
+    Message next(std::move(_raised[_raisedhead++]));
+    Dispatch(next);
+  }
+  ClearRaised();
+}
+
+void StateMachine::ClearRaised()
+{
+  _raised.clear();
+  _raisedhead = 0;
+}
+
+void StateMachine::Dispatch(const Message& msg)
+{
+#ifdef FSM_ENABLE_USDT
+  //save the outer event's index in case this is a nested Handle
+  const int outerevent = _traceevent;
+  //the lookup only happens while a tracer is attached
+  const bool tracing = FSM_PROBE_ENABLED(handle__begin) ||
+    FSM_PROBE_ENABLED(handle__end) || FSM_PROBE_ENABLED(handler__begin) ||
+    FSM_PROBE_ENABLED(handler__end);
+  _traceevent = tracing ? GetEventIndex(msg.event) : -1;
+#endif
+  FSM_PROBE3(handle__begin, this, msg.event.c_str(), _traceevent);
+  evhsequence* found = nullptr;
+  std::shared_ptr<evhsequence> resolved;
+  if(_patternhandlers.empty()){
+    //fast path: nothing but exact matches
+    auto it = _eventhandlers.find(msg.event);
+    if(it != _eventhandlers.end())
+      found = &it->second;
+  }
+  else{
+    resolved = ResolveHandlers(msg.event);
+    found = resolved.get();
+  }
+  if(!found){
     //todo: do we want to cause an error if we don't have a handler?
   }
   else{
-    for(auto& seqhandler : it->second){
-      statehandler& sh = seqhandler.second;
-      //make sure this handler is referencing this state
-      if(sh.state != nullstate && sh.state != currentid)
-	continue;
-      //call the callback
-      stateid_t nextid = (sh.handler)(_current_state.get(), msg);
-      //do we need to transition?
-      if(nextid != nullstate && nextid != currentid){
-	Transition(nextid);
-	currentid = GetCurrentStateID();
-	//todo: handle errors generated during transition
-      }
-      //is this an override sequence?
-      if(seqhandler.first < 0)
+    evhsequence& handlers = *found;
+    auto group = handlers.begin();
+    while(group != handlers.end()){
+      //handlers with the same sequence are contiguous in the multimap
+      auto groupend = handlers.upper_bound(group->first);
+      if(!HandleGroup(group, groupend, msg))
 	break;
+      group = groupend;
     }
   }
-  return status;
+  FSM_PROBE3(handle__end, this, _traceevent, status);
+#ifdef FSM_ENABLE_USDT
+  _traceevent = outerevent;
+#endif
+}
+
+bool StateMachine::HandleGroup(evhsequence::iterator first,
+			       evhsequence::iterator last, const Message& msg)
+{
+  const bool override = first->first < 0;
+  stateid_t currentid = GetCurrentStateID();
+  std::vector<statehandler*> parallel;
+  if(!override){
+    for(auto it = first; it != last; ++it){
+      statehandler& sh = it->second;
+      if(sh.parallel && (sh.state == nullstate || sh.state == currentid))
+	parallel.push_back(&sh);
+    }
+    //a lone parallel handler just runs in sequence with the rest
+    if(parallel.size() > 1){
+      RunParallel(parallel, first->first, msg);
+      currentid = GetCurrentStateID();
+    }
+    else
+      parallel.clear();
+  }
+  for(auto it = first; it != last; ++it){
+    statehandler& sh = it->second;
+    //already ran above
+    if(sh.parallel && !parallel.empty())
+      continue;
+    //make sure this handler is referencing this state
+    if(sh.state != nullstate && sh.state != currentid)
+      continue;
+    //call the callback
+    FSM_PROBE4(handler__begin, this, _traceevent, _tracestate, it->first);
+    stateid_t nextid = (*sh.handler)(_current_state.get(), msg);
+    FSM_PROBE4(handler__end, this, _traceevent, _tracestate,
+	       GetStateIndex(nextid));
+    //do we need to transition?
+    if(nextid != nullstate && nextid != currentid){
+      Transition(nextid);
+      currentid = GetCurrentStateID();
+      //todo: handle errors generated during transition
+    }
+    //is this an override sequence?
+    if(override)
+      return false;
+  }
+  return true;
 }
 
+void StateMachine::RunParallel(const std::vector<statehandler*>& handlers,
+			       int sequence, const Message& msg)
+{
+  if(!_threadpool)
+    _threadpool = ThreadPool::GetShared();
+  (void)sequence; //only used by tracepoints
+  VState* st = _current_state.get();
+  std::vector<stateid_t> next(handlers.size(), nullstate);
+  _inparallel = true;
+  try{
+    _threadpool->RunBatch(handlers.size(), [&](size_t i){
+	FSM_PROBE4(handler__begin, this, _traceevent, _tracestate, sequence);
+	next[i] = (*handlers[i]->handler)(st, msg);
+	FSM_PROBE4(handler__end, this, _traceevent, _tracestate,
+		   GetStateIndex(next[i]));
+      });
+  }
+  catch(...){
+    _inparallel = false;
+    throw;
+  }
+  _inparallel = false;
+
+  //merge in registration order so the outcome doesn't depend on timing
+  stateid_t currentid = GetCurrentStateID();
+  stateid_t nextid = nullstate;
+  for(auto& id : next){
+    if(id == nullstate || id == currentid || id == nextid)
+      continue;
+    if(nextid == nullstate || _conflictpolicy == CONFLICT_LAST)
+      nextid = id;
+    else if(_conflictpolicy == CONFLICT_ERROR){
+      std::stringstream err;
+      err<<"Parallel handlers for event "<<msg.event
+	 <<" requested conflicting transitions to "<<nextid.name()
+	 <<" and "<<id.name();
+      ProduceError(TRANSITION_CONFLICT, err.str());
+      return;
+    }
+  }
+  if(nextid != nullstate)
+    Transition(nextid);
+}
+
+
+std::shared_ptr<StateMachine::evhsequence>
+StateMachine::ResolveHandlers(const event_t& evt)
+{
+  auto cached = _resolved.find(evt);
+  if(cached != _resolved.end())
+    return cached->second;
+  //first time we've seen this event since registrations last changed
+  std::shared_ptr<evhsequence> merged;
+  auto exact = _eventhandlers.find(evt);
+  if(exact != _eventhandlers.end() && !exact->second.empty())
+    merged = std::make_shared<evhsequence>(exact->second);
+  for(auto& pattern : _patternhandlers){
+    if(pattern.second.empty() || !MatchEvent(pattern.first, evt))
+      continue;
+    if(!merged)
+      merged = std::make_shared<evhsequence>();
+    merged->insert(pattern.second.begin(), pattern.second.end());
+  }
+  //cache misses too, so unhandled events don't rescan the patterns
+  if(_resolved.size() >= MAXRESOLVED)
+    _resolved.clear();
+  _resolved[evt] = merged;
+  return merged;
+}
+
+bool StateMachine::MatchEvent(const event_t& pattern, const event_t& evt)
+{
+  //iterative glob match; backtrack only to the most recent '*'
+  size_t p = 0, e = 0, star = event_t::npos, mark = 0;
+  while(e < evt.size()){
+    if(p < pattern.size() && pattern[p] == '*'){
+      star = p++;
+      mark = e;
+    }
+    else if(p < pattern.size() && pattern[p] == evt[e]){
+      ++p;
+      ++e;
+    }
+    else if(star != event_t::npos){
+      p = star+1;
+      e = ++mark;
+    }
+    else
+      return false;
+  }
+  while(p < pattern.size() && pattern[p] == '*')
+    ++p;
+  return p == pattern.size();
+}
 
 status_t StateMachine::Transition(stateid_t nextid, bool checkfirst)
 {
@@ -66,9 +397,19 @@ status_t StateMachine::Transition(stateid_t nextid, bool checkfirst)
     nextid = GetStateID<DefaultErrorHandler>();
   }
   //make sure the current state's exit gets called first
+  _previous_state = GetCurrentStateID();
+  mstick_t entered = _current_state ? _current_state->GetTimeEntered() : 0;
   _current_state.reset(nullptr);
   //now instantiate the new state
-  _current_state.reset(_statefactory[nextid]->enter(this));
+  VStateFactory& factory = *_statefactory[nextid];
+  _current_state.reset(factory.enter(this));
+#ifdef FSM_ENABLE_USDT
+  const int fromindex = _tracestate;
+  _tracestate = factory.index;
+#endif
+  FSM_PROBE3(transition, this, fromindex, _tracestate);
+  if(_observer)
+    _observer->OnTransition(*this, _previous_state, entered);
   
   return status;
 }
@@ -90,39 +431,65 @@ int StateMachine::RemoveEventHandler(const event_t& evt, int sequence,
 				     const stateid_t& st)
 {
   int nfound = 0;
-  auto matchrange = _eventhandlers[evt].equal_range(sequence);
-  for(auto it = matchrange.first; it != matchrange.second; ++it){
-    statehandler& sh = it->second;
-    if(sh.state == st) {
-      _eventhandlers[evt].erase(it);
-      ++nfound;
+  auto& table = IsEventPattern(evt) ? _patternhandlers : _eventhandlers;
+  auto evit = table.find(evt);
+  if(evit != table.end()){
+    evhsequence& handlers = evit->second;
+    auto matchrange = handlers.equal_range(sequence);
+    for(auto it = matchrange.first; it != matchrange.second; ){
+      if(it->second.state == st) {
+	it = handlers.erase(it);
+	++nfound;
+      }
+      else
+	++it;
     }
   }
-  return nfound;
+  if(nfound)
+    _resolved.clear();
   if(nfound == 0){
-    std::cerr<<"Warning in RemoveEventHandler; no handler registered for \n"
-	     <<"event "<<evt<<" sequence "<<sequence
-	     <<" and state "<<st<<std::endl;
+    std::stringstream warn;
+    warn<<"RemoveEventHandler: no handler registered for event "<<evt
+	<<" sequence "<<sequence<<" and state "<<st.name();
+    Log(LOG_WARNING, warn.str(), this);
   }
   return nfound;
 }
 
+void StateMachine::WriteSymbolMap(std::ostream& out) const
+{
+  out<<"machine "<<static_cast<const void*>(this)<<'\n';
+  for(auto& entry : _stateindex){
+    auto factory = _statefactory.find(entry.first);
+    out<<"state "<<entry.second<<' '
+       <<(factory != _statefactory.end() ? factory->second->name :
+	  std::string(entry.first.name()))<<'\n';
+  }
+  for(auto& entry : _eventindex)
+    out<<"event "<<entry.second<<' '<<entry.first<<'\n';
+}
+
 int StateMachine::RemoveAllHandlers(const event_t& evt)
 {
   int nfound = 0;
   if(evt == ""){
-    nfound = _eventhandlers.size();
+    nfound = _eventhandlers.size() + _patternhandlers.size();
     _eventhandlers.clear();
+    _patternhandlers.clear();
+  }
+  else if(IsEventPattern(evt)){
+    nfound = _patternhandlers.erase(evt);
   }
   else{
     nfound = _eventhandlers.erase(evt);
   }
+  _resolved.clear();
   return nfound;
 }
 
 StateMachine::DefaultErrorHandler::DefaultErrorHandler(StateMachine* sm) : 
   VState(sm)
 {
-  std::cerr<<"State machine has encountered error "<<sm->GetStatus()<<":\n"
-	   <<sm->GetStatusMsg()<<'\n';
+  Log(LOG_ERROR, "State machine has encountered error: "+sm->GetStatusMsg(),
+      sm, sm->GetPreviousStateName(), sm->GetStatus());
 }
@@ -1,3 +1,6 @@
+#ifndef STATEMACHINE_h
+#define STATEMACHINE_h
+
 #include <vector>
 #include <string>
 #include <map>
@@ -7,6 +10,8 @@
 #include <memory>
 #include <stdexcept>
 #include <sstream>
+#include <mutex>
+#include <atomic>
 
 #include "Message.hh"
 #include "EventHandler.hh"
@@ -15,6 +20,20 @@
 #include "define.hh"
 
 namespace fsm{
+  class ThreadPool;
+  class StateMachine;
+
+  ///Told about every state change of the machines it is attached to
+  class TransitionObserver{
+  public:
+    virtual ~TransitionObserver() {}
+    /** Called from Transition once the new state has been entered.
+	@param fromid   state that was left; nullstate if there was none
+	@param entered  time the state that was left had been entered
+    */
+    virtual void OnTransition(StateMachine& sm, stateid_t fromid,
+			      mstick_t entered) = 0;
+  };
   
   class StateMachine{
   public:
@@ -25,6 +44,8 @@ namespace fsm{
       STATUS_OK = 0,
       CURRENT_STATE_UNDEFINED = -1,
       UNKNOWN_STATE_REQUESTED = -2,
+      TRANSITION_CONFLICT = -3,
+      RAISE_LIMIT_EXCEEDED = -4,
     };
 
     enum SEQUENCE {
@@ -34,6 +55,13 @@ namespace fsm{
       SEQ_OVERRIDE = -1,
     };
 
+    ///How to resolve different transitions requested by parallel handlers
+    enum CONFLICTPOLICY {
+      CONFLICT_FIRST, ///< first handler in registration order wins
+      CONFLICT_LAST,  ///< last handler in registration order wins
+      CONFLICT_ERROR, ///< don't transition; set TRANSITION_CONFLICT status
+    };
+
     //some useful utility states
     class DefaultErrorHandler : public VState{
     public:
@@ -74,12 +102,81 @@ namespace fsm{
     { return _statefactory.count(_previous_state) ? 
 	_statefactory[_previous_state]->name : "" ; 
     }
+
+    ///Attach an observer to be told about each transition; nullptr detaches
+    void SetTransitionObserver(TransitionObserver* observer)
+    { _observer = observer; }
+    TransitionObserver* GetTransitionObserver() const { return _observer; }
   
-    ///handle an incoming message (event)
+    /** handle an incoming message (event). Events already waiting from
+	Post are dispatched first, in order, then the message.
+    */
     virtual status_t Handle(const Message& msg);
 
     ///explicitly handle a bare event
     status_t Handle(const event_t& event){ return Handle(Message(event)); }
+
+    /** Raise a follow-up event from inside a handler. The event is queued
+	and dispatched once the current event's handlers have all run, by
+	the outermost Handle call, in the order raised. Follow-ups, and
+	their own follow-ups, run before the next posted event. Outside of
+	Handle this is the same as calling Handle directly. A payload the message
+	points to but doesn't own must stay valid until it is dispatched.
+	Must not be called from handlers registered as parallel (asserted).
+    */
+    status_t Raise(const Message& msg);
+    status_t Raise(Message&& msg);
+    status_t Raise(const event_t& event){ return Raise(Message(event)); }
+
+    /** Queue an event without dispatching it. Posted events are handled
+	in order by the next ProcessQueue or Handle call, ahead of the
+	event given to Handle and subject to the coalescing policy for
+	their event type. Unlike the rest of the machine, safe to call from
+	any thread, including from handlers; an event posted while a
+	ProcessQueue or Handle call is running waits for the next one.
+    */
+    void Post(const Message& msg);
+    void Post(Message&& msg);
+    void Post(const event_t& event){ Post(Message(event)); }
+
+    ///Dispatch everything posted so far, each with its raised follow-ups
+    status_t ProcessQueue();
+
+    /** Limit on follow-ups raised while handling any one event, counting
+	those raised by follow-ups, to catch livelock. The rest are dropped
+	with RAISE_LIMIT_EXCEEDED.
+    */
+    void SetMaxRaised(size_t maxraised){ _maxraised = maxraised; }
+
+    ///How queued copies of the same event are combined
+    enum COALESCEPOLICY {
+      COALESCE_NONE,        ///< every copy is dispatched (default)
+      COALESCE_KEEP_LATEST, ///< one dispatch with the newest payload
+      COALESCE_KEEP_FIRST,  ///< one dispatch with the oldest payload
+      COALESCE_MERGE,       ///< one dispatch; payloads combined by a function
+      COALESCE_COUNT,       ///< one dispatch; only Message::count matters
+    };
+
+    ///Fold `incoming` into the already-queued `queued` for COALESCE_MERGE
+    using MergeFunc = std::function<void(Message& queued,
+					 const Message& incoming)>;
+
+    /** Set how an event type is coalesced while waiting in the queue. An
+	incoming copy is folded into the queued one only if no event
+	without a coalescing policy has been queued after it, so ordering
+	relative to those is preserved. The dispatched Message's `count`
+	says how many raw events it stands for. Only posted events are
+	coalesced; events passed to Handle or raised by handlers never are.
+    */
+    void SetCoalescePolicy(const event_t& evt, COALESCEPOLICY policy,
+			   MergeFunc merge=nullptr);
+
+    struct CoalesceStats{
+      size_t ncoalesced = 0; ///< copies folded into an already-queued one
+      size_t ndropped = 0;   ///< payloads discarded by KEEP_LATEST/FIRST
+    };
+    ///Get coalescing counters for an event type
+    CoalesceStats GetCoalesceStats(const event_t& evt) const;
   
     ///register a state to handle events
     template<class T> void RegisterState(std::string name="",
@@ -90,12 +187,16 @@ namespace fsm{
 	  name = GetStateID<T>().name();
 	_statefactory[GetStateID<T>()] = 
 	  std::unique_ptr<VStateFactory>(new StateFactory<T,isvstate>(name));
+	_stateindex.insert({GetStateID<T>(), int(_stateindex.size())});
+	_statefactory[GetStateID<T>()]->index = _stateindex[GetStateID<T>()];
       }
     }  
 
     /** Register a callback function when an event is received.
 	If `state` is given, it only fires if the state machine is in that state
-	@param evt      The event type to handle
+	@param evt      The event type to handle. May be a pattern where `*`
+	                matches any run of characters, e.g. "net::*" for a
+			whole namespace or "*::CONNECT"; see MatchEvent
 	@param handler  The function callback. Can be any of several types;
 	                see EventHandlers.hh for call signatures
 	@param sequence If multiple callbacks are registered for the same event,
@@ -107,27 +208,39 @@ namespace fsm{
 			will fire. 
 	@param state    Optional ID of the state to associate callback to. If
 	                `nullstate` (default), will fire in any state
+	@param parallel If true, the handler does not modify shared state and
+	                may run concurrently with other parallel handlers of the
+			same sequence (see SetThreadPool). All of them see the
+			state current at the start of the sequence group; their
+			requested transitions are merged per SetConflictPolicy.
+			Ignored for override sequences.
 	---
 	@returns an integer with 0 indicating success
     */	
     template<class Handler> 
     int RegisterEventHandler(const event_t& evt, Handler handler,
 			     int sequence=SEQ_DEFAULT,
-			     const stateid_t& state=nullstate)
+			     const stateid_t& state=nullstate,
+			     bool parallel=false)
     {
-      _eventhandlers[evt].insert({sequence, statehandler{state, 
-	      eh::MakeEventHandler(handler)} });
+      auto& table = IsEventPattern(evt) ? _patternhandlers : _eventhandlers;
+      table[evt].insert({sequence, statehandler{state, 
+	      std::make_shared<EventHandler>(eh::MakeEventHandler(handler)),
+	      parallel} });
+      _eventindex.insert({evt, int(_eventindex.size())});
+      _resolved.clear();
       return 0;
     }
 
     ///Alternate signature to register handler, giving state as template param
     template<class State, class Handler> 
     int RegisterEventHandler(const event_t& evt, Handler handler, 
-			     int sequence=SEQ_DEFAULT)
+			     int sequence=SEQ_DEFAULT, bool parallel=false)
     {
       //allow silently registering the state too
       RegisterState<State>();
-      return RegisterEventHandler(evt, handler, sequence, GetStateID<State>());
+      return RegisterEventHandler(evt, handler, sequence, GetStateID<State>(),
+				  parallel);
       
     }
     
@@ -137,6 +250,34 @@ namespace fsm{
     
     ///Remove all event handlers for the given event, or all totally
     int RemoveAllHandlers(const event_t& evt="");
+
+    ///Dense index of a registered state in registration order, or -1
+    int GetStateIndex(const stateid_t& id) const {
+      auto it = _stateindex.find(id);
+      return it == _stateindex.end() ? -1 : it->second;
+    }
+
+    ///Dense index of an event (or pattern) with handlers, or -1
+    int GetEventIndex(const event_t& evt) const {
+      auto it = _eventindex.find(evt);
+      return it == _eventindex.end() ? -1 : it->second;
+    }
+
+    ///Write the index-to-name tables used by tracepoints; see Trace.hh
+    void WriteSymbolMap(std::ostream& out) const;
+
+    ///Is `evt` a wildcard pattern rather than a plain event label?
+    static bool IsEventPattern(const event_t& evt)
+    { return evt.find('*') != event_t::npos; }
+
+    ///Does `evt` match `pattern`? `*` matches any (possibly empty) substring
+    static bool MatchEvent(const event_t& pattern, const event_t& evt);
+
+    ///Set the pool used for parallel handlers; default is ThreadPool::GetShared
+    void SetThreadPool(std::shared_ptr<ThreadPool> pool){ _threadpool = pool; }
+
+    ///Set how conflicting transitions from parallel handlers are resolved
+    void SetConflictPolicy(CONFLICTPOLICY policy){ _conflictpolicy = policy; }
 						   
     ///start the machine running
     virtual status_t Start(const stateid_t& initialState);
@@ -172,12 +313,87 @@ namespace fsm{
     std::string status_msg;
     std::unique_ptr<VState> _current_state = nullptr;
     stateid_t _previous_state;
+    TransitionObserver* _observer = nullptr;
     status_t ProduceError(status_t code, const std::string& message);
  
     std::map<stateid_t, std::unique_ptr<VStateFactory> > _statefactory;
-    struct statehandler{stateid_t state; EventHandler handler;};
+    std::map<stateid_t, int> _stateindex;
+    std::unordered_map<event_t, int> _eventindex;
+    //indices for tracepoints; only maintained with FSM_ENABLE_USDT
+    int _traceevent = -1;
+    int _tracestate = -1;
+    //the handler is shared so merged sequences in _resolved call the
+    //registered object itself, not a copy
+    struct statehandler{
+      stateid_t state;
+      std::shared_ptr<EventHandler> handler;
+      bool parallel;
+    };
     using evhsequence = std::multimap<int, statehandler>;
     std::unordered_map<event_t, evhsequence> _eventhandlers;
+    std::unordered_map<event_t, evhsequence> _patternhandlers;
+
+    /** Exact and pattern handlers merged per event, filled lazily and only
+	used once a pattern has been registered. Entries are shared_ptrs so
+	a Handle in progress keeps its sequence alive if a handler changes
+	the registrations and the cache is cleared. Emptied when it reaches
+	MAXRESOLVED entries, so dynamically built labels can't grow it
+	without bound.
+    */
+    static const size_t MAXRESOLVED = 4096;
+    std::unordered_map<event_t, std::shared_ptr<evhsequence> > _resolved;
+    std::shared_ptr<evhsequence> ResolveHandlers(const event_t& evt);
+
+    std::shared_ptr<ThreadPool> _threadpool;
+    CONFLICTPOLICY _conflictpolicy = CONFLICT_FIRST;
+
+    //run-to-completion queues; storage is reused. Posted events collect in
+    //_posted under _postmutex, and each Handle or ProcessQueue call swaps
+    //them out into _draining. Raised events are only touched by the
+    //dispatching thread.
+    std::vector<Message> _raised;
+    size_t _raisedhead = 0;
+    std::vector<Message> _posted;
+    std::vector<Message> _draining;
+    size_t _postbarrier = 0;     ///< just past the last non-coalescable entry
+    size_t _postgen = 0;         ///< bumped whenever _posted is swapped out
+    std::atomic<bool> _haveposted{false}; ///< skip the lock when none
+    mutable std::mutex _postmutex; ///< guards _posted and _coalesce
+    size_t _maxraised = 10000;
+    bool _dispatching = false;
+    bool _inparallel = false;    ///< parallel handlers are running
+
+    struct coalesceinfo{
+      COALESCEPOLICY policy = COALESCE_NONE;
+      MergeFunc merge;
+      size_t slot = 0;        ///< queue index of the waiting copy
+      size_t generation = -1; ///< _postgen when slot was set
+      CoalesceStats stats;
+    };
+    std::unordered_map<event_t, coalesceinfo> _coalesce;
+
+    ///Add to _posted, coalescing if the event's policy allows; needs the lock
+    void Enqueue(Message&& msg);
+
+    ///Dispatch the raised events, and whatever they raise, in order
+    void DrainRaised();
+
+    ///Empty the raised queue
+    void ClearRaised();
+
+    ///Run all handlers for one event
+    void Dispatch(const Message& msg);
+
+    ///Dispatch msg, plus anything queued, with _dispatching set
+    status_t RunToCompletion(const Message* msg);
+
+    ///Run all handlers sharing one sequence number; false stops the event
+    bool HandleGroup(evhsequence::iterator first, evhsequence::iterator last,
+		     const Message& msg);
+
+    ///Run parallel-safe handlers concurrently and apply the merged transition
+    void RunParallel(const std::vector<statehandler*>& handlers,
+		     int sequence, const Message& msg);
       
     virtual status_t Transition(stateid_t nextid, bool checkfirst=false);
 
@@ -244,3 +460,5 @@ void fsm::StateMachine::RemoveObject(const fsm::StateMachine::objkey_t& key)
 {
   _stored_objects.erase(key);
 }
+
+#endif
@@ -0,0 +1,110 @@
+#include "ThreadPool.hh"
+#include <algorithm>
+#include <exception>
+
+using namespace fsm;
+
+struct ThreadPool::Batch{
+  const std::function<void(size_t)>* func;
+  size_t n;
+  std::atomic<size_t> next;
+  std::atomic<size_t> active;  ///< workers currently holding a pointer to us
+  std::mutex errmutex;
+  std::exception_ptr error;
+};
+
+ThreadPool::ThreadPool(size_t nthreads)
+{
+  if(nthreads == 0){
+    size_t hw = std::thread::hardware_concurrency();
+    nthreads = hw > 1 ? hw-1 : 0;
+  }
+  for(size_t i=0; i<nthreads; ++i)
+    _workers.emplace_back(&ThreadPool::WorkerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _wake.notify_all();
+  for(auto& t : _workers)
+    t.join();
+}
+
+void ThreadPool::Work(Batch& batch)
+{
+  size_t i;
+  while((i = batch.next++) < batch.n){
+    try{
+      (*batch.func)(i);
+    }
+    catch(...){
+      std::lock_guard<std::mutex> lock(batch.errmutex);
+      if(!batch.error)
+	batch.error = std::current_exception();
+    }
+  }
+}
+
+void ThreadPool::WorkerLoop()
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  for(;;){
+    _wake.wait(lock, [this]{ return _stop || !_batches.empty(); });
+    if(_stop)
+      return;
+    Batch* batch = _batches.front();
+    if(batch->next.load() >= batch->n){
+      //fully claimed; nothing left for us
+      _batches.pop_front();
+      continue;
+    }
+    ++batch->active;
+    lock.unlock();
+    Work(*batch);
+    --batch->active;
+    lock.lock();
+  }
+}
+
+void ThreadPool::RunBatch(size_t n, const std::function<void(size_t)>& func)
+{
+  if(n == 0)
+    return;
+  if(n == 1 || _workers.empty()){
+    for(size_t i=0; i<n; ++i)
+      func(i);
+    return;
+  }
+  Batch batch;
+  batch.func = &func;
+  batch.n = n;
+  batch.next = 0;
+  batch.active = 0;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _batches.push_back(&batch);
+  }
+  _wake.notify_all();
+  Work(batch);
+  {
+    //after this no new worker can pick the batch up
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = std::find(_batches.begin(), _batches.end(), &batch);
+    if(it != _batches.end())
+      _batches.erase(it);
+  }
+  while(batch.active.load() != 0)
+    std::this_thread::yield();
+  if(batch.error)
+    std::rethrow_exception(batch.error);
+}
+
+std::shared_ptr<ThreadPool> ThreadPool::GetShared()
+{
+  static std::shared_ptr<ThreadPool> pool(new ThreadPool);
+  return pool;
+}
@@ -0,0 +1,56 @@
+#ifndef THREADPOOL_h
+#define THREADPOOL_h
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+namespace fsm{
+
+  /** Minimal fork/join pool used to run parallel-safe event handlers.
+      The calling thread always takes part in its own batch, so RunBatch may
+      safely be called from inside a task already running on the pool.
+  */
+  class ThreadPool{
+  public:
+    ///Start `nthreads` workers; 0 means one per hardware thread, minus one
+    ///for the caller
+    ThreadPool(size_t nthreads=0);
+
+    ///Stop and join all workers
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ///Number of worker threads (not counting callers)
+    size_t GetNThreads() const { return _workers.size(); }
+
+    /** Call func(i) for every i in [0,n) and wait for all calls to finish.
+	If any call throws, the first exception is rethrown here after the
+	rest of the batch completes.
+    */
+    void RunBatch(size_t n, const std::function<void(size_t)>& func);
+
+    ///Process-wide pool shared by all state machines by default
+    static std::shared_ptr<ThreadPool> GetShared();
+
+  private:
+    struct Batch;
+    void WorkerLoop();
+    static void Work(Batch& batch);
+
+    std::vector<std::thread> _workers;
+    std::deque<Batch*> _batches;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    bool _stop = false;
+  };
+};
+
+#endif
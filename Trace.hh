@@ -0,0 +1,60 @@
+#ifndef TRACE_h
+#define TRACE_h
+
+/** Static tracepoints for profiling live processes with perf or bpftrace.
+
+    Compile with -DFSM_ENABLE_USDT (needs <sys/sdt.h>, e.g. from the
+    systemtap-sdt-dev package) to emit USDT probes in provider `fsm`. Each
+    probe has a semaphore that perf and bpftrace set while attached; until
+    then a probe costs one load and a not-taken branch, and its arguments
+    are not evaluated. Without the flag the macros vanish. `make -C test
+    usdt-check` builds genbench this way and checks with readelf that every
+    probe below is present with a semaphore.
+
+      handle__begin   (machine, event label, event index)
+      handle__end     (machine, event index, status)
+      handler__begin  (machine, event index, state index, sequence)
+      handler__end    (machine, event index, state index, next state index)
+      transition      (machine, from state index, to state index)
+
+    Indices are per machine, from StateMachine::GetStateIndex and
+    GetEventIndex; -1 means none. StateMachine::WriteSymbolMap dumps the
+    index-to-name tables, and tools/fsmsym rewrites `state=N`/`event=N`
+    in trace output into names. For example:
+
+      bpftrace -e 'usdt:./app:fsm:handler__begin { @s[tid] = nsecs; }
+        usdt:./app:fsm:handler__end /@s[tid]/ {
+          printf("machine=%p event=%d state=%d ns=%d\n", arg0, arg1, arg2,
+                 nsecs - @s[tid]); delete(@s[tid]); }' \
+        | fsmsym app-symbols.map
+*/
+
+#ifdef FSM_ENABLE_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+//defined in StateMachine.cc; names are fixed by the sdt.h convention
+extern "C" {
+  extern unsigned short fsm_handle__begin_semaphore;
+  extern unsigned short fsm_handle__end_semaphore;
+  extern unsigned short fsm_handler__begin_semaphore;
+  extern unsigned short fsm_handler__end_semaphore;
+  extern unsigned short fsm_transition_semaphore;
+}
+
+#define FSM_PROBE_ENABLED(name) \
+  __builtin_expect(fsm_##name##_semaphore != 0, 0)
+#define FSM_PROBE2(name, a, b) do{ if(FSM_PROBE_ENABLED(name)) \
+      DTRACE_PROBE2(fsm, name, a, b); }while(0)
+#define FSM_PROBE3(name, a, b, c) do{ if(FSM_PROBE_ENABLED(name)) \
+      DTRACE_PROBE3(fsm, name, a, b, c); }while(0)
+#define FSM_PROBE4(name, a, b, c, d) do{ if(FSM_PROBE_ENABLED(name)) \
+      DTRACE_PROBE4(fsm, name, a, b, c, d); }while(0)
+#else
+#define FSM_PROBE_ENABLED(name)      false
+#define FSM_PROBE2(name, a, b)       do{}while(0)
+#define FSM_PROBE3(name, a, b, c)    do{}while(0)
+#define FSM_PROBE4(name, a, b, c, d) do{}while(0)
+#endif
+
+#endif
@@ -12,11 +12,9 @@ namespace fsm{
   using stateid_t = std::type_index;
   
   using mstick_t = std::chrono::milliseconds::rep;
-  inline mstick_t mstick(){
-    using namespace std::chrono;
-    return duration_cast<milliseconds>(system_clock::now()
-				       .time_since_epoch()).count();
-  }
+
+  ///Current time in ms according to the library clock; see Clock.hh
+  mstick_t mstick();
 };
 
 inline std::ostream& operator<<(std::ostream& out, const fsm::stateid_t& sid)
@@ -0,0 +1,109 @@
+#include <cassert>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include "StateMachine.hh"
+
+using namespace fsm;
+
+const event_t POLL   = "coalesce::POLL";
+const event_t CONFIG = "coalesce::CONFIG";
+const event_t TICK   = "coalesce::TICK";
+const event_t STOP   = "coalesce::STOP";
+
+std::string trace;
+
+void record(const Message& msg)
+{
+  trace += msg.event.substr(10) + "(" + std::to_string(msg.count);
+  if(msg.GetDataSize())
+    trace += "," + std::string(msg.GetDataString());
+  trace += ") ";
+}
+
+int main()
+{
+  StateMachine sm;
+  for(auto& evt : {POLL, CONFIG, TICK, STOP})
+    sm.RegisterEventHandler(evt, record);
+  sm.SetCoalescePolicy(POLL, StateMachine::COALESCE_COUNT);
+  sm.SetCoalescePolicy(CONFIG, StateMachine::COALESCE_KEEP_LATEST);
+  sm.SetCoalescePolicy(TICK, StateMachine::COALESCE_MERGE,
+		       [](Message& queued, const Message& incoming){
+			 //keep the concatenated payload
+			 std::string both = std::string(queued.GetDataString())
+			   + incoming.GetDataString();
+			 queued = Message(queued.event, both);
+		       });
+
+  for(int i=0; i<100; ++i)
+    sm.Post(POLL);
+  sm.Post(Message(CONFIG, "a"));
+  sm.Post(Message(TICK, "x"));
+  sm.Post(Message(CONFIG, "b"));
+  sm.Post(Message(TICK, "y"));
+  //STOP has no policy, so later POLLs may not jump ahead of it
+  sm.Post(STOP);
+  sm.Post(POLL);
+  sm.Post(POLL);
+  assert(trace.empty());
+  assert(sm.ProcessQueue() == StateMachine::STATUS_OK);
+  assert(trace == "POLL(100) CONFIG(2,b) TICK(2,xy) STOP(1) POLL(2) ");
+
+  assert(sm.GetCoalesceStats(POLL).ncoalesced == 100);
+  assert(sm.GetCoalesceStats(CONFIG).ndropped == 1);
+  assert(sm.GetCoalesceStats(TICK).ncoalesced == 1);
+
+  //a dispatched copy can't absorb later ones
+  trace.clear();
+  sm.Post(POLL);
+  sm.ProcessQueue();
+  sm.Post(POLL);
+  sm.ProcessQueue();
+  assert(trace == "POLL(1) POLL(1) ");
+
+  //Handle doesn't jump ahead of events already posted
+  trace.clear();
+  sm.Post(Message(CONFIG, "c"));
+  sm.Post(STOP);
+  sm.Handle(Message(TICK, "z"));
+  assert(trace == "CONFIG(1,c) STOP(1) TICK(1,z) ");
+
+  //a posted backlog bigger than the livelock limit is not dropped
+  trace.clear();
+  sm.SetMaxRaised(100);
+  for(int i=0; i<1000; ++i)
+    sm.Post(STOP);
+  assert(sm.ProcessQueue() == StateMachine::STATUS_OK);
+  assert(trace.size() == 1000*std::string("STOP(1) ").size());
+
+  //other threads post while the owner drains; nothing is lost
+  StateMachine shared;
+  size_t npolls = 0;
+  shared.RegisterEventHandler(POLL, EventHandler
+    ([&npolls](VState*, const Message& msg){
+      npolls += msg.count;
+      return nullstate;
+    }));
+  shared.SetCoalescePolicy(POLL, StateMachine::COALESCE_COUNT);
+  const int NTHREADS = 4, NPOSTS = 100000;
+  std::atomic<int> nfinished(0);
+  std::vector<std::thread> posters;
+  for(int i=0; i<NTHREADS; ++i)
+    posters.emplace_back([&]{
+	for(int j=0; j<NPOSTS; ++j)
+	  shared.Post(POLL);
+	++nfinished;
+      });
+  while(nfinished < NTHREADS)
+    shared.ProcessQueue();
+  for(auto& t : posters)
+    t.join();
+  shared.ProcessQueue();
+  assert(npolls == size_t(NTHREADS*NPOSTS));
+
+  std::cout<<"coalesce.cc: OK"<<std::endl;
+  return 0;
+}
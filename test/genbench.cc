@@ -0,0 +1,68 @@
+/** Compare dispatch through code generated by tools/fsmgen against the same
+    machine registered at runtime.
+
+    build: make genbench (regenerates genbench_fsm.hh when the spec changes)
+    usage: genbench [nevents]
+*/
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cassert>
+#include <cstdlib>
+#include "StateMachine.hh"
+
+using namespace fsm;
+
+struct Active{};
+struct InActive{};
+
+size_t npoll = 0, nstore = 0, nprint = 0;
+void active_poll(VState*, const Message&){ ++npoll; }
+void inactive_poll(VState*, const Message&){ ++npoll; }
+void storemsg(VState*, const Message&){ ++nstore; }
+void printmsg(VState*, const Message&){ ++nprint; }
+
+#include "genbench_fsm.hh"
+
+using steady = std::chrono::steady_clock;
+
+int main(int argc, char** argv)
+{
+  size_t nevents = argc > 1 ? atol(argv[1]) : 10000000;
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int> pick(0, GenBench_fsm::NEVENTS-1);
+  std::vector<Message> stream;
+  stream.reserve(nevents);
+  for(size_t i=0; i<nevents; ++i)
+    stream.emplace_back(GenBench_fsm::event_labels[pick(rng)]);
+
+  //runtime-registered machine
+  StateMachine sm;
+  GenBench_fsm::Register(sm);
+  sm.Start(GetStateID<InActive>());
+  auto start = steady::now();
+  for(auto& msg : stream)
+    sm.Handle(msg);
+  double runtime = std::chrono::duration<double>(steady::now()-start).count();
+  size_t counts = npoll + nstore + nprint;
+  GenBench_fsm::State final = GenBench_fsm::FromStateID(sm.GetCurrentStateID());
+
+  //generated dispatch
+  npoll = nstore = nprint = 0;
+  GenBench_fsm::State cur = GenBench_fsm::S_InActive;
+  start = steady::now();
+  for(auto& msg : stream)
+    cur = GenBench_fsm::Dispatch(cur, GenBench_fsm::LookupEvent(msg.event),
+				 nullptr, msg);
+  double generated = std::chrono::duration<double>(steady::now()-start).count();
+
+  //both paths must agree
+  assert(cur == final);
+  assert(counts == npoll + nstore + nprint);
+
+  std::cout<<"genbench.cc: "<<nevents<<" events\n"
+	   <<"  runtime:   "<<runtime*1e9/nevents<<" ns/event\n"
+	   <<"  generated: "<<generated*1e9/nevents<<" ns/event"<<std::endl;
+  return 0;
+}
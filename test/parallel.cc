@@ -0,0 +1,55 @@
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include "StateMachine.hh"
+#include "ThreadPool.hh"
+
+using namespace fsm;
+
+const event_t PUBLISH = "parallel::PUBLISH";
+
+struct Idle{};
+struct Busy{};
+struct Failed{};
+
+std::atomic<int> ncalls(0);
+
+void count(){ ++ncalls; }
+stateid_t tobusy(){ ++ncalls; return GetStateID<Busy>(); }
+stateid_t tofailed(){ ++ncalls; return GetStateID<Failed>(); }
+
+int main()
+{
+  StateMachine sm;
+  sm.SetThreadPool(std::make_shared<ThreadPool>(3));
+  sm.RegisterState<Idle>("Idle");
+  sm.RegisterState<Busy>("Busy");
+  sm.RegisterState<Failed>("Failed");
+  for(int i=0; i<4; ++i)
+    sm.RegisterEventHandler(PUBLISH, count, StateMachine::SEQ_DEFAULT,
+			    nullstate, true);
+  sm.RegisterEventHandler<Idle>(PUBLISH, tobusy, StateMachine::SEQ_DEFAULT,
+				true);
+  sm.RegisterEventHandler<Idle>(PUBLISH, tofailed, StateMachine::SEQ_DEFAULT,
+				true);
+  //runs after the parallel group, in the state it transitioned to
+  sm.RegisterEventHandler<Busy>(PUBLISH, count, StateMachine::SEQ_LAST);
+
+  sm.Start(GetStateID<Idle>());
+  assert(sm.Handle(PUBLISH) == StateMachine::STATUS_OK);
+  assert(ncalls == 7);
+  assert(sm.GetCurrentStateID() == GetStateID<Busy>());
+
+  sm.Start(GetStateID<Idle>());
+  sm.SetConflictPolicy(StateMachine::CONFLICT_LAST);
+  sm.Handle(PUBLISH);
+  assert(sm.GetCurrentStateID() == GetStateID<Failed>());
+
+  sm.Start(GetStateID<Idle>());
+  sm.SetConflictPolicy(StateMachine::CONFLICT_ERROR);
+  assert(sm.Handle(PUBLISH) == StateMachine::TRANSITION_CONFLICT);
+  assert(sm.GetCurrentStateID() == GetStateID<Idle>());
+
+  std::cout<<"parallel.cc: OK"<<std::endl;
+  return 0;
+}
@@ -0,0 +1,123 @@
+/** Drive a large Population of device trackers with table-driven events,
+    plus one handler that needs the full state path.
+
+    usage: population [nmachines] [nrounds]
+*/
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cassert>
+#include <cstdlib>
+#include "Population.hh"
+
+using namespace fsm;
+
+const event_t CONNECT    = "population::CONNECT";
+const event_t DISCONNECT = "population::DISCONNECT";
+const event_t HEARTBEAT  = "population::HEARTBEAT";
+const event_t TIMEOUT    = "population::TIMEOUT";
+const event_t RESET      = "population::RESET";
+
+struct Offline{};
+struct Online{};
+struct Stale{};
+
+using Devices = Population<uint16_t>;
+
+//needs the machine's data, so goes through the handler path
+stateid_t reset(VState* st)
+{
+  Devices::Machine* m = Devices::GetMachine(st);
+  ++m->GetData(); //count resets
+  return GetStateID<Offline>();
+}
+
+void touch(VState*){}
+
+///Registering a transition again retargets it on both paths
+void check_retarget()
+{
+  const event_t RETARGET = "population::RETARGET";
+  Devices pop(2);
+  pop.RegisterTransition<Offline, Online>(RETARGET);
+  pop.RegisterTransition<Offline, Stale>(RETARGET);
+  pop.Start(GetStateID<Offline>());
+  pop.ApplyAll(RETARGET);
+  assert(pop.GetStateIDOf(0) == GetStateID<Stale>());
+  //a handler on the same event sends Offline machines down the slow path
+  pop.Start(GetStateID<Offline>());
+  pop.RegisterEventHandler<Offline>(RETARGET, touch);
+  pop.ApplyAll(RETARGET);
+  assert(pop.GetStateIDOf(0) == GetStateID<Stale>());
+  assert(pop.GetStateIDOf(1) == GetStateID<Stale>());
+}
+
+using steady = std::chrono::steady_clock;
+
+int main(int argc, char** argv)
+{
+  size_t nmachines = argc > 1 ? atol(argv[1]) : 10000000;
+  size_t nrounds = argc > 2 ? atol(argv[2]) : 10;
+
+  check_retarget();
+
+  Devices pop(nmachines);
+  pop.RegisterTransition<Offline, Online>(CONNECT);
+  pop.RegisterTransition<Stale, Online>(CONNECT);
+  pop.RegisterTransition<Online, Offline>(DISCONNECT);
+  pop.RegisterTransition<Stale, Offline>(DISCONNECT);
+  pop.RegisterTransition<Stale, Online>(HEARTBEAT);
+  pop.RegisterTransition<Online, Stale>(TIMEOUT);
+  pop.RegisterEventHandler<Stale>(RESET, reset);
+  pop.Start(GetStateID<Offline>());
+
+  std::mt19937 rng(7);
+  std::uniform_int_distribution<Devices::machineid_t> pick(0, nmachines-1);
+  std::vector<Devices::machineid_t> batch(nmachines/10);
+
+  //whole-population events
+  auto start = steady::now();
+  const event_t all[] = {CONNECT, TIMEOUT, HEARTBEAT, TIMEOUT, DISCONNECT};
+  for(size_t r=0; r<nrounds; ++r)
+    for(auto& evt : all)
+      pop.ApplyAll(evt);
+  double secs = std::chrono::duration<double>(steady::now()-start).count();
+  std::cout<<"population.cc: ApplyAll: "<<secs*1e9/(nrounds*5*nmachines)
+	   <<" ns/machine-event ("<<nmachines<<" machines)"<<std::endl;
+  assert(pop.CountByState()[pop.GetStateIndex(GetStateID<Offline>())]
+	 == nmachines);
+
+  //random batches, as arriving traffic would look
+  double batchsecs = 0;
+  for(size_t r=0; r<nrounds; ++r){
+    for(auto& id : batch) id = pick(rng);
+    const event_t& evt = all[r % 5];
+    start = steady::now();
+    pop.Apply(evt, batch);
+    batchsecs += std::chrono::duration<double>(steady::now()-start).count();
+  }
+  std::cout<<"population.cc: Apply (random batch): "
+	   <<batchsecs*1e9/(nrounds*batch.size())<<" ns/machine-event"
+	   <<std::endl;
+
+  //slow path: only the Stale machines run the handler
+  pop.ApplyAll(CONNECT);
+  pop.ApplyAll(TIMEOUT);
+  for(Devices::machineid_t id=0; id<1000 && id<nmachines; ++id)
+    pop.SetState(id, GetStateID<Online>());
+  start = steady::now();
+  pop.ApplyAll(RESET);
+  secs = std::chrono::duration<double>(steady::now()-start).count();
+  size_t nreset = 0;
+  for(size_t i=0; i<nmachines; ++i)
+    nreset += pop.GetData(i);
+  assert(nreset == nmachines - std::min<size_t>(1000, nmachines));
+  std::cout<<"population.cc: handler path: "<<secs*1e9/nreset
+	   <<" ns/machine-event"<<std::endl;
+
+  std::cout<<"population.cc: "<<sizeof(Devices::stateidx_t) + sizeof(uint16_t)
+	   <<" bytes/machine vs "<<sizeof(StateMachine)
+	   <<"+ bytes for one StateMachine"<<std::endl;
+  return 0;
+}
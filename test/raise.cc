@@ -0,0 +1,92 @@
+#include <cassert>
+#include <iostream>
+#include <string>
+#include "StateMachine.hh"
+
+using namespace fsm;
+
+const event_t START = "raise::START";
+const event_t STEP  = "raise::STEP";
+const event_t SPIN  = "raise::SPIN";
+const event_t A     = "raise::A";
+const event_t A2    = "raise::A2";
+const event_t B     = "raise::B";
+
+struct Idle{};
+struct Running{};
+
+std::string trace;
+int depth = 0, maxdepth = 0;
+
+stateid_t start(VState* st)
+{
+  ++depth;
+  maxdepth = std::max(depth, maxdepth);
+  trace += "start ";
+  st->GetStateMachine()->Raise(STEP);
+  st->GetStateMachine()->Raise(STEP);
+  --depth;
+  return GetStateID<Running>();
+}
+
+//runs after the transition above, even though STEP was raised before it
+void step(VState*)
+{
+  ++depth;
+  maxdepth = std::max(depth, maxdepth);
+  trace += "step ";
+  --depth;
+}
+
+void finish(){ trace += "finish "; }
+
+void spin(VState* st){ st->GetStateMachine()->Raise(SPIN); }
+
+int main()
+{
+  StateMachine sm;
+  sm.RegisterEventHandler<Idle>(START, start);
+  sm.RegisterEventHandler<Idle>(START, finish, StateMachine::SEQ_LAST);
+  sm.RegisterEventHandler<Running>(STEP, step);
+  sm.RegisterEventHandler(SPIN, spin);
+
+  sm.Start(GetStateID<Idle>());
+  assert(sm.Handle(START) == StateMachine::STATUS_OK);
+  //the SEQ_LAST handler is filtered out after the transition to Running
+  assert(trace == "start step step ");
+  assert(maxdepth == 1);
+
+  sm.SetMaxRaised(100);
+  assert(sm.Handle(SPIN) == StateMachine::RAISE_LIMIT_EXCEEDED);
+  //the queue is left empty for the next event
+  sm.ResetStatus();
+  trace.clear();
+  assert(sm.Handle(STEP) == StateMachine::STATUS_OK);
+  assert(trace == "step ");
+
+  //follow-ups run before the next posted event, whether the queue is
+  //drained by ProcessQueue or by Handle
+  StateMachine rtc;
+  rtc.RegisterEventHandler(A, EventHandler([&rtc](VState*, const Message&){
+	trace += "A ";
+	rtc.Raise(A2);
+	return nullstate;
+      }));
+  for(auto& evt : {A2, B})
+    rtc.RegisterEventHandler(evt, EventHandler([](VState*, const Message& m){
+	  trace += m.event.substr(7) + " ";
+	  return nullstate;
+	}));
+  trace.clear();
+  rtc.Post(A);
+  rtc.Post(B);
+  assert(rtc.ProcessQueue() == StateMachine::STATUS_OK);
+  assert(trace == "A A2 B ");
+  trace.clear();
+  rtc.Post(A);
+  assert(rtc.Handle(B) == StateMachine::STATUS_OK);
+  assert(trace == "A A2 B ");
+
+  std::cout<<"raise.cc: OK"<<std::endl;
+  return 0;
+}
@@ -0,0 +1,282 @@
+/** Compare posting events to a StateMachine in another process through the
+    shared-memory ring against a plain pipe carrying the same bytes.
+
+    Throughput comes from a free-running producer. Latency comes from a
+    separate ping-pong run: the producer sends one event, the consumer's
+    handler answers with an acknowledgement over a second channel, and the
+    producer waits for it before sending the next one. A saturated run only
+    measures how deep each transport's buffer is, not its latency.
+
+    usage: shmbench [nevents] [payload bytes] [nroundtrips]
+    build: g++ -std=c++11 -O2 -I.. shmbench.cc ../[A-Z]*.cc -o shmbench -lrt -pthread
+*/
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "StateMachine.hh"
+#include "ShmTransport.hh"
+
+using namespace fsm;
+using steady = std::chrono::steady_clock;
+
+const event_t TICK = "shmbench::TICK";
+const event_t ACK  = "shmbench::ACK";
+const event_t DONE = "shmbench::DONE";
+
+inline int64_t nsnow()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>
+    (steady::now().time_since_epoch()).count();
+}
+
+void report_throughput(const char* name, size_t nevents, double seconds)
+{
+  std::cout<<name<<": "<<nevents/seconds/1e6<<" Mevents/s"<<std::endl;
+}
+
+void report_latency(const char* name, std::vector<int64_t>& rtt)
+{
+  std::sort(rtt.begin(), rtt.end());
+  auto pct = [&](double p){ return rtt[size_t(p*(rtt.size()-1))]/1000.; };
+  std::cout<<name<<": round trip us p50="<<pct(0.5)<<" p99="<<pct(0.99)
+	   <<" p99.9="<<pct(0.999)<<" max="<<pct(1.0)<<std::endl;
+}
+
+///Counts TICKs and notices DONE
+struct Counter{
+  size_t nticks = 0;
+  bool done = false;
+  void setup(StateMachine& sm){
+    sm.RegisterEventHandler(TICK, EventHandler([this](VState*, const Message&)
+					       { ++nticks; return nullstate; }));
+    sm.RegisterEventHandler(DONE, EventHandler([this](VState*, const Message&)
+					       { done = true; return nullstate; }));
+  }
+};
+
+/**** pipe framing: length-prefixed records, copied into each Message ****/
+
+bool pipe_send(int fd, std::vector<char>& buf, const event_t& evt,
+	       const void* data, size_t n)
+{
+  uint32_t hdr[2] = {uint32_t(evt.size()), uint32_t(n)};
+  buf.resize(sizeof(hdr) + evt.size() + n);
+  memcpy(buf.data(), hdr, sizeof(hdr));
+  memcpy(buf.data()+sizeof(hdr), evt.data(), evt.size());
+  if(n)
+    memcpy(buf.data()+sizeof(hdr)+evt.size(), data, n);
+  return write(fd, buf.data(), buf.size()) == ssize_t(buf.size());
+}
+
+bool pipe_readall(int fd, char* out, size_t n)
+{
+  while(n){
+    ssize_t got = read(fd, out, n);
+    if(got <= 0) return false;
+    out += got; n -= got;
+  }
+  return true;
+}
+
+///Read one record and hand it to `sm`
+bool pipe_recv(int fd, std::vector<char>& buf, StateMachine& sm)
+{
+  uint32_t hdr[2];
+  if(!pipe_readall(fd, (char*)hdr, sizeof(hdr)))
+    return false;
+  buf.resize(hdr[0] + hdr[1]);
+  if(!pipe_readall(fd, buf.data(), buf.size()))
+    return false;
+  Message msg(event_t(buf.data(), hdr[0]), buf.data()+hdr[0], hdr[1], true);
+  sm.Handle(msg);
+  return true;
+}
+
+/**** throughput ****/
+
+void throughput_shm(size_t nevents, size_t payload)
+{
+  const std::string name = "/fsm-shmbench-" + std::to_string(getpid());
+  ShmConsumer consumer(name, 1<<20);
+  pid_t child = fork();
+  if(child == 0){
+    ShmProducer producer(name);
+    std::vector<char> buf(payload);
+    for(size_t i=0; i<nevents; ++i)
+      producer.Post(TICK, buf.data(), buf.size());
+    producer.Post(DONE);
+    _exit(0);
+  }
+  StateMachine sm;
+  Counter counter;
+  counter.setup(sm);
+  auto start = steady::now();
+  while(!counter.done){
+    if(consumer.Wait(1000) == shm::SHM_PEER_DEAD){
+      std::cerr<<"producer died early"<<std::endl;
+      break;
+    }
+    consumer.Poll(sm);
+  }
+  double secs = std::chrono::duration<double>(steady::now()-start).count();
+  waitpid(child, nullptr, 0);
+  report_throughput("shm ", counter.nticks, secs);
+}
+
+void throughput_pipe(size_t nevents, size_t payload)
+{
+  int fds[2];
+  if(pipe(fds) != 0){ perror("pipe"); return; }
+  pid_t child = fork();
+  if(child == 0){
+    close(fds[0]);
+    std::vector<char> data(payload), buf;
+    for(size_t i=0; i<nevents; ++i)
+      if(!pipe_send(fds[1], buf, TICK, data.data(), data.size())) _exit(1);
+    pipe_send(fds[1], buf, DONE, nullptr, 0);
+    _exit(0);
+  }
+  close(fds[1]);
+  StateMachine sm;
+  Counter counter;
+  counter.setup(sm);
+  std::vector<char> buf;
+  auto start = steady::now();
+  while(!counter.done && pipe_recv(fds[0], buf, sm))
+    ;
+  double secs = std::chrono::duration<double>(steady::now()-start).count();
+  close(fds[0]);
+  waitpid(child, nullptr, 0);
+  report_throughput("pipe", counter.nticks, secs);
+}
+
+/**** ping-pong latency ****/
+
+///Child side: send a TICK, wait for the ACK, repeat; prints the report
+template<class Send, class Receive>
+void pingpong(const char* name, size_t nrounds, size_t payload,
+	      Send send, Receive receive)
+{
+  StateMachine sm;
+  bool acked = false;
+  sm.RegisterEventHandler(ACK, EventHandler([&acked](VState*, const Message&)
+					    { acked = true; return nullstate; }));
+  std::vector<char> data(payload);
+  std::vector<int64_t> rtt;
+  rtt.reserve(nrounds);
+  for(size_t i=0; i<nrounds; ++i){
+    acked = false;
+    int64_t start = nsnow();
+    if(!send(TICK, data))
+      break;
+    while(!acked)
+      if(!receive(sm))
+	return;
+    rtt.push_back(nsnow() - start);
+  }
+  send(DONE, std::vector<char>());
+  report_latency(name, rtt);
+}
+
+void latency_shm(size_t nrounds, size_t payload)
+{
+  const std::string name = "/fsm-shmbench-" + std::to_string(getpid());
+  const std::string replyname = name + "-reply";
+  ShmConsumer consumer(name, 1<<20);
+  pid_t child = fork();
+  if(child == 0){
+    {
+      //create the reply ring before the first TICK, so it exists by the time
+      //the parent goes looking for it
+      ShmConsumer replies(replyname, 1<<16);
+      ShmProducer producer(name);
+      pingpong("shm ", nrounds, payload,
+	       [&](const event_t& evt, const std::vector<char>& data){
+		 return producer.Post(evt, data.data(), data.size())
+		   == shm::SHM_OK;
+	       },
+	       [&](StateMachine& sm){
+		 if(replies.Wait(1000) == shm::SHM_PEER_DEAD)
+		   return false;
+		 replies.Poll(sm);
+		 return true;
+	       });
+    }
+    std::cout.flush();
+    _exit(0);
+  }
+  StateMachine sm;
+  std::unique_ptr<ShmProducer> reply;
+  bool done = false;
+  sm.RegisterEventHandler(TICK, EventHandler([&](VState*, const Message&){
+	if(!reply)
+	  reply.reset(new ShmProducer(replyname));
+	reply->Post(ACK);
+	return nullstate;
+      }));
+  sm.RegisterEventHandler(DONE, EventHandler([&done](VState*, const Message&)
+					     { done = true; return nullstate; }));
+  while(!done){
+    if(consumer.Wait(1000) == shm::SHM_PEER_DEAD)
+      break;
+    consumer.Poll(sm);
+  }
+  reply.reset();
+  waitpid(child, nullptr, 0);
+}
+
+void latency_pipe(size_t nrounds, size_t payload)
+{
+  int ping[2], pong[2];
+  if(pipe(ping) != 0 || pipe(pong) != 0){ perror("pipe"); return; }
+  pid_t child = fork();
+  if(child == 0){
+    close(ping[0]);
+    close(pong[1]);
+    std::vector<char> sendbuf, recvbuf;
+    pingpong("pipe", nrounds, payload,
+	     [&](const event_t& evt, const std::vector<char>& data){
+	       return pipe_send(ping[1], sendbuf, evt, data.data(), data.size());
+	     },
+	     [&](StateMachine& sm){ return pipe_recv(pong[0], recvbuf, sm); });
+    std::cout.flush();
+    _exit(0);
+  }
+  close(ping[1]);
+  close(pong[0]);
+  StateMachine sm;
+  std::vector<char> sendbuf, recvbuf;
+  bool done = false;
+  sm.RegisterEventHandler(TICK, EventHandler([&](VState*, const Message&){
+	pipe_send(pong[1], sendbuf, ACK, nullptr, 0);
+	return nullstate;
+      }));
+  sm.RegisterEventHandler(DONE, EventHandler([&done](VState*, const Message&)
+					     { done = true; return nullstate; }));
+  while(!done && pipe_recv(ping[0], recvbuf, sm))
+    ;
+  close(ping[0]);
+  close(pong[1]);
+  waitpid(child, nullptr, 0);
+}
+
+int main(int argc, char** argv)
+{
+  size_t nevents = argc > 1 ? atol(argv[1]) : 1000000;
+  size_t payload = argc > 2 ? atol(argv[2]) : 64;
+  size_t nrounds = argc > 3 ? atol(argv[3]) : 100000;
+  std::cout<<"shmbench.cc: "<<nevents<<" events, "<<payload
+	   <<" byte payload, "<<nrounds<<" round trips"<<std::endl;
+  std::cout.flush();
+  throughput_shm(nevents, payload);
+  throughput_pipe(nevents, payload);
+  latency_shm(nrounds, payload);
+  latency_pipe(nrounds, payload);
+  return 0;
+}
@@ -0,0 +1,111 @@
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "StateMachine.hh"
+#include "ShmTransport.hh"
+
+using namespace fsm;
+
+const event_t PING = "shmtransport::PING";
+
+bool attach_fails(const std::string& name)
+{
+  try{
+    ShmProducer producer(name);
+  }
+  catch(std::runtime_error&){
+    return true;
+  }
+  return false;
+}
+
+int main()
+{
+  const std::string name = "/fsm-shmtransport-" + std::to_string(getpid());
+  StateMachine sm;
+  int npings = 0;
+  sm.RegisterEventHandler(PING, EventHandler([&](VState*, const Message&)
+					     { ++npings; return nullstate; }));
+
+  //single-producer ring: a second live producer is turned away, and the
+  //slot frees up again once the first one detaches
+  {
+    ShmConsumer consumer(name, 4096);
+    std::unique_ptr<ShmProducer> first(new ShmProducer(name));
+    assert(attach_fails(name));
+    assert(first->Post(PING) == shm::SHM_OK);
+    first.reset();
+    ShmProducer second(name);
+    assert(second.Post(PING) == shm::SHM_OK);
+    assert(consumer.Poll(sm) == 2);
+    assert(npings == 2);
+  }
+
+  //multi-producer ring: any number may attach
+  {
+    ShmConsumer consumer(name, 4096, true);
+    ShmProducer a(name), b(name);
+    assert(a.Post(PING) == shm::SHM_OK);
+    assert(b.Post(PING) == shm::SHM_OK);
+    assert(consumer.Poll(sm) == 2);
+    assert(npings == 4);
+  }
+
+  //a backlog handed over with PostTo coalesces in the machine's queue
+  {
+    StateMachine counted;
+    unsigned nraw = 0, ndispatched = 0;
+    counted.RegisterEventHandler(PING, EventHandler
+      ([&](VState*, const Message& msg){
+	nraw += msg.count;
+	++ndispatched;
+	return nullstate;
+      }));
+    counted.SetCoalescePolicy(PING, StateMachine::COALESCE_COUNT);
+    ShmConsumer consumer(name, 4096);
+    ShmProducer producer(name);
+    for(int i=0; i<10; ++i)
+      assert(producer.Post(PING) == shm::SHM_OK);
+    assert(consumer.PostTo(counted) == 10);
+    assert(consumer.GetUsed() == 0);
+    assert(counted.ProcessQueue() == StateMachine::STATUS_OK);
+    assert(nraw == 10 && ndispatched == 1);
+  }
+
+  //producers in several processes contending for the write lock
+  {
+    const int NPROC = 4, NPOSTS = 20000;
+    ShmConsumer consumer(name, 4096, true);
+    pid_t kids[NPROC];
+    for(int i=0; i<NPROC; ++i){
+      kids[i] = fork();
+      if(kids[i] == 0){
+	int err = shm::SHM_OK;
+	{
+	  ShmProducer producer(name);
+	  for(int j=0; j<NPOSTS && err == shm::SHM_OK; ++j)
+	    err = producer.Post(PING);
+	}
+	_exit(err == shm::SHM_OK ? 0 : 1);
+      }
+    }
+    npings = 0;
+    while(npings < NPROC*NPOSTS && consumer.Wait(5000) == shm::SHM_OK)
+      consumer.Poll(sm);
+    assert(npings == NPROC*NPOSTS);
+    for(int i=0; i<NPROC; ++i){
+      int status = -1;
+      waitpid(kids[i], &status, 0);
+      assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+  }
+
+  //the consumer is gone
+  assert(attach_fails(name));
+
+  std::cout<<"shmtransport.cc: OK"<<std::endl;
+  return 0;
+}
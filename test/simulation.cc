@@ -0,0 +1,97 @@
+/** Fast-forward a fleet of simple machines through simulated days of
+    traffic and print the dwell/transition report.
+
+    usage: simulation [nmachines] [days]
+*/
+#include <iostream>
+#include <random>
+#include <chrono>
+#include <cassert>
+#include <cstdlib>
+#include "StateMachine.hh"
+#include "Simulation.hh"
+
+using namespace fsm;
+
+const event_t ACTIVATE   = "simulation::ACTIVATE";
+const event_t DEACTIVATE = "simulation::DEACTIVATE";
+
+const mstick_t HOUR = 3600*1000;
+
+struct Active{};
+struct InActive{};
+
+///A state passed through by a raised event is still counted
+void check_raised()
+{
+  Simulation sim;
+  StateMachine sm;
+  sm.RegisterState<Active>("Active");
+  sm.RegisterState<InActive>("InActive");
+  sm.RegisterEventHandler<InActive>(ACTIVATE, EventHandler
+    ([&sm](VState*, const Message&){
+      sm.Raise(DEACTIVATE);
+      return GetStateID<Active>();
+    }));
+  sm.RegisterEventHandler<Active>(DEACTIVATE, EventHandler
+    ([](VState*, const Message&){ return GetStateID<InActive>(); }));
+  sm.Start(GetStateID<InActive>());
+  sim.Schedule(5, &sm, ACTIVATE);
+  assert(sim.Run() == 1);
+  auto& counts = sim.GetTransitionCounts();
+  assert(counts.size() == 2);
+  assert(counts.at(std::make_pair(GetStateID<InActive>(),
+				  GetStateID<Active>())) == 1);
+  assert(counts.at(std::make_pair(GetStateID<Active>(),
+				  GetStateID<InActive>())) == 1);
+  auto& stats = sim.GetStateStats();
+  assert(stats.at(GetStateID<Active>()).nentered == 1);
+  assert(stats.at(GetStateID<Active>()).dwell == 0);
+  assert(stats.at(GetStateID<InActive>()).dwell == 5);
+  assert(sm.GetTransitionObserver() == nullptr);
+}
+
+int main(int argc, char** argv)
+{
+  size_t nmachines = argc > 1 ? atol(argv[1]) : 1000;
+  mstick_t days = argc > 2 ? atol(argv[2]) : 7;
+  const mstick_t end = days*24*HOUR;
+
+  check_raised();
+  Simulation sim;
+  std::mt19937 rng(1234);
+  std::exponential_distribution<double> busy(1./HOUR), idle(1./(3*HOUR));
+
+  std::vector<std::unique_ptr<StateMachine> > fleet;
+  for(size_t i=0; i<nmachines; ++i){
+    StateMachine* sm = new StateMachine;
+    fleet.emplace_back(sm);
+    sm->RegisterState<Active>("Active");
+    sm->RegisterState<InActive>("InActive");
+    //each transition schedules the next one in simulated time
+    sm->RegisterEventHandler<InActive>(ACTIVATE, EventHandler
+      ([&sim, &rng, &busy, sm](VState*, const Message&){
+	sim.ScheduleIn(busy(rng), sm, DEACTIVATE);
+	return GetStateID<Active>();
+      }));
+    sm->RegisterEventHandler<Active>(DEACTIVATE, EventHandler
+      ([&sim, &rng, &idle, sm](VState*, const Message&){
+	sim.ScheduleIn(idle(rng), sm, ACTIVATE);
+	return GetStateID<InActive>();
+      }));
+    sm->Start(GetStateID<InActive>());
+    assert(sm->GetCurrentState()->GetTimeEntered() == 0);
+    sim.ScheduleIn(idle(rng), sm, ACTIVATE);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  sim.Run(end);
+  double secs = std::chrono::duration<double>
+    (std::chrono::steady_clock::now() - start).count();
+  assert(sim.Now() <= end);
+
+  sim.Report(std::cout);
+  std::cout<<"simulation.cc: "<<sim.GetNDispatched()<<" events in "<<secs
+	   <<" s real time"<<std::endl;
+  return 0;
+}
@@ -0,0 +1,360 @@
+/** Multi-threaded load/soak harness.
+
+    Producer threads post a weighted mix of events to randomly chosen
+    machines built from the test/simple.cc states, including stored-object
+    access and trips through the error state. The run is repeated for
+    1, 2, 4, ... up to --threads producers to give a scaling curve.
+
+    usage: soak [--machines N] [--threads N] [--seconds S] [--rate R]
+                [--mix poll=60,activate=8,deactivate=8,store=10,print=10,
+                       break=2,restart=2]
+
+    --rate is events/s per thread; 0 (default) runs closed-loop as fast as
+    possible. With a rate, an event that is sent late is timed from its
+    scheduled send time, so stalls show up in the tail instead of being
+    hidden by the producer slowing down.
+
+    Each StateMachine is guarded by its own mutex, since machines are not
+    thread-safe; the latency therefore includes lock contention.
+*/
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <cstdlib>
+#include <cstring>
+#include <sys/resource.h>
+#include "StateMachine.hh"
+#include "Logger.hh"
+
+using namespace fsm;
+using steady = std::chrono::steady_clock;
+
+/**** allocation counting ****/
+
+static thread_local size_t tl_nallocs = 0;
+
+void* operator new(size_t size)
+{
+  ++tl_nallocs;
+  if(void* p = malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { free(p); }
+
+/**** the machine, after test/simple.cc ****/
+
+//file scope, so it is built before and torn down after the library's sinks;
+//a replaced sink's writer thread keeps running until exit
+std::ostream discard(nullptr);
+
+const event_t POLL       = "soak::POLL";
+const event_t ACTIVATE   = "soak::ACTIVATE";
+const event_t DEACTIVATE = "soak::DEACTIVATE";
+const event_t STOREMSG   = "soak::STOREMSG";
+const event_t PRINTMSG   = "soak::PRINTMSG";
+const event_t BREAK      = "soak::BREAK";
+const event_t RESTART    = "soak::RESTART";
+
+struct NoState{};
+struct InActive;
+
+struct Active{
+  size_t npolls = 0;
+  void poll(){ ++npolls; }
+  stateid_t deactivate(){ return GetStateID<InActive>(); }
+  void storemsg(VState* st){
+    st->GetStateMachine()->RegisterObject("message", "active message");
+  }
+};
+
+struct InActive{
+  size_t npolls = 0;
+  void poll(){ ++npolls; }
+  stateid_t activate(){ return GetStateID<Active>(); }
+  void storemsg(VState* st){
+    st->GetStateMachine()->RegisterObject("message", "inactive message");
+  }
+  stateid_t Break(){ return GetStateID<NoState>(); }
+};
+
+void printmsg(VState* st)
+{
+  //read the stored object the way a real handler would
+  volatile size_t len = st->GetStateMachine()->
+    GetObject<std::string>("message").size();
+  (void)len;
+}
+
+stateid_t restart(){ return GetStateID<InActive>(); }
+
+struct Guarded{
+  std::mutex lock;
+  StateMachine sm;
+  Guarded(){
+    sm.RegisterState<Active>("Active");
+    sm.RegisterState<InActive>("InActive");
+    sm.RegisterEventHandler<Active>(POLL, &Active::poll);
+    sm.RegisterEventHandler<InActive>(POLL, &InActive::poll);
+    sm.RegisterEventHandler<InActive>(ACTIVATE, &InActive::activate);
+    sm.RegisterEventHandler<Active>(DEACTIVATE, &Active::deactivate);
+    sm.RegisterEventHandler<InActive>(BREAK, &InActive::Break);
+    sm.RegisterEventHandler<Active>(STOREMSG, &Active::storemsg);
+    sm.RegisterEventHandler<InActive>(STOREMSG, &InActive::storemsg);
+    sm.RegisterEventHandler(PRINTMSG, printmsg);
+    sm.RegisterEventHandler<StateMachine::DefaultErrorHandler>(RESTART,
+							      restart);
+    sm.RegisterObject("message", "initial message");
+    sm.Start(GetStateID<InActive>());
+  }
+};
+
+/**** log-linear latency histogram, HDR style ****/
+
+class Histogram{
+public:
+  //16 sub-buckets per power of 2: about 6% relative precision
+  static const int SUBBITS = 4;
+  static const int NBUCKETS = 64 << SUBBITS;
+
+  Histogram() : _counts(NBUCKETS, 0) {}
+
+  void Record(uint64_t ns){
+    ++_counts[Bucket(ns)];
+    ++_total;
+    if(ns > _max) _max = ns;
+  }
+
+  void Merge(const Histogram& other){
+    for(int i=0; i<NBUCKETS; ++i)
+      _counts[i] += other._counts[i];
+    _total += other._total;
+    if(other._max > _max) _max = other._max;
+  }
+
+  ///Upper edge of the bucket holding quantile q
+  uint64_t Percentile(double q) const {
+    uint64_t target = q * _total, seen = 0;
+    for(int i=0; i<NBUCKETS; ++i){
+      seen += _counts[i];
+      if(seen > target)
+	return std::min(UpperEdge(i), _max);
+    }
+    return _max;
+  }
+
+  uint64_t GetTotal() const { return _total; }
+  uint64_t GetMax() const { return _max; }
+
+private:
+  static int Bucket(uint64_t v){
+    if(v < (1u << SUBBITS))
+      return v;
+    int msb = 63 - __builtin_clzll(v);
+    int sub = (v >> (msb - SUBBITS)) & ((1 << SUBBITS) - 1);
+    return ((msb - SUBBITS + 1) << SUBBITS) + sub;
+  }
+  static uint64_t UpperEdge(int bucket){
+    if(bucket < (1 << SUBBITS))
+      return bucket;
+    int msb = (bucket >> SUBBITS) + SUBBITS - 1;
+    uint64_t sub = bucket & ((1 << SUBBITS) - 1);
+    return ((sub | (1u << SUBBITS)) + 1) << (msb - SUBBITS);
+  }
+
+  std::vector<uint64_t> _counts;
+  uint64_t _total = 0;
+  uint64_t _max = 0;
+};
+
+/**** harness ****/
+
+struct Config{
+  size_t nmachines = 10000;
+  size_t maxthreads = std::max(1u, std::thread::hardware_concurrency());
+  double seconds = 10;
+  double rate = 0;
+  std::vector<std::pair<event_t, unsigned> > mix = {
+    {POLL, 60}, {ACTIVATE, 8}, {DEACTIVATE, 8}, {STOREMSG, 10},
+    {PRINTMSG, 10}, {BREAK, 2}, {RESTART, 2}
+  };
+};
+
+struct ThreadResult{
+  Histogram latency;
+  size_t nevents = 0;
+  size_t nallocs = 0;
+  size_t nerrors = 0;
+};
+
+void producer(const Config& cfg, std::vector<std::unique_ptr<Guarded> >& fleet,
+	      unsigned seed, steady::time_point end, ThreadResult& result)
+{
+  std::mt19937_64 rng(seed);
+  std::uniform_int_distribution<size_t> pickmachine(0, fleet.size()-1);
+  std::vector<unsigned> weights;
+  for(auto& entry : cfg.mix)
+    weights.push_back(entry.second);
+  std::discrete_distribution<size_t> pickevent(weights.begin(), weights.end());
+  //pre-build messages so the loop measures the library, not std::string
+  std::vector<Message> messages;
+  for(auto& entry : cfg.mix)
+    messages.emplace_back(entry.first);
+
+  const auto interval = cfg.rate > 0 ?
+    std::chrono::duration_cast<steady::duration>
+    (std::chrono::duration<double>(1./cfg.rate)) : steady::duration(0);
+  auto scheduled = steady::now();
+  size_t allocs0 = tl_nallocs;
+  while(true){
+    auto start = steady::now();
+    if(cfg.rate > 0){
+      //behind schedule, the backlog counts as latency; ahead of it, the
+      //sleep's wakeup jitter does not
+      scheduled += interval;
+      if(scheduled > start){
+	std::this_thread::sleep_until(scheduled);
+	start = steady::now();
+      }
+      else
+	start = scheduled;
+    }
+    if(start >= end)
+      break;
+    Guarded& g = *fleet[pickmachine(rng)];
+    const Message& msg = messages[pickevent(rng)];
+    {
+      std::lock_guard<std::mutex> lock(g.lock);
+      if(g.sm.Handle(msg) != StateMachine::STATUS_OK){
+	++result.nerrors;
+	g.sm.ResetStatus();
+      }
+    }
+    auto done = steady::now();
+    result.latency.Record(std::chrono::duration_cast<std::chrono::nanoseconds>
+			  (done - start).count());
+    ++result.nevents;
+  }
+  result.nallocs = tl_nallocs - allocs0;
+}
+
+void usage(const char* prog)
+{
+  std::cerr<<"usage: "<<prog<<" [--machines N] [--threads N] [--seconds S]"
+	   <<" [--rate R] [--mix name=weight,...]"<<std::endl;
+  exit(2);
+}
+
+Config parseargs(int argc, char** argv)
+{
+  Config cfg;
+  const std::pair<const char*, event_t> names[] = {
+    {"poll", POLL}, {"activate", ACTIVATE}, {"deactivate", DEACTIVATE},
+    {"store", STOREMSG}, {"print", PRINTMSG}, {"break", BREAK},
+    {"restart", RESTART}
+  };
+  for(int i=1; i<argc; ++i){
+    std::string arg = argv[i];
+    if(i+1 >= argc) usage(argv[0]);
+    std::string val = argv[++i];
+    if(arg == "--machines") cfg.nmachines = atol(val.c_str());
+    else if(arg == "--threads") cfg.maxthreads = atol(val.c_str());
+    else if(arg == "--seconds") cfg.seconds = atof(val.c_str());
+    else if(arg == "--rate") cfg.rate = atof(val.c_str());
+    else if(arg == "--mix"){
+      cfg.mix.clear();
+      std::istringstream items(val);
+      std::string item;
+      while(std::getline(items, item, ',')){
+	size_t eq = item.find('=');
+	bool found = false;
+	for(auto& name : names){
+	  if(item.compare(0, eq, name.first) == 0 && eq != std::string::npos){
+	    cfg.mix.push_back({name.second,
+		  unsigned(atoi(item.c_str()+eq+1))});
+	    found = true;
+	  }
+	}
+	if(!found){
+	  std::cerr<<"unknown event in mix: "<<item<<std::endl;
+	  usage(argv[0]);
+	}
+      }
+    }
+    else usage(argv[0]);
+  }
+  if(cfg.nmachines == 0 || cfg.maxthreads == 0 || cfg.mix.empty())
+    usage(argv[0]);
+  return cfg;
+}
+
+int main(int argc, char** argv)
+{
+  Config cfg = parseargs(argc, argv);
+
+  //error bursts are part of the load; keep the log output out of the report
+  SetLogSink(std::make_shared<AsyncLogSink>(discard));
+
+  std::vector<std::unique_ptr<Guarded> > fleet;
+  for(size_t i=0; i<cfg.nmachines; ++i)
+    fleet.emplace_back(new Guarded);
+
+  std::cout<<"soak.cc: "<<cfg.nmachines<<" machines, "<<cfg.seconds
+	   <<" s per step, rate "<<(cfg.rate > 0 ? std::to_string(cfg.rate) :
+				    std::string("unlimited"))<<" per thread\n"
+	   <<std::setw(8)<<"threads"<<std::setw(14)<<"events/s"
+	   <<std::setw(10)<<"p50 us"<<std::setw(10)<<"p99 us"
+	   <<std::setw(11)<<"p99.9 us"<<std::setw(11)<<"max us"
+	   <<std::setw(14)<<"allocs/s"<<std::setw(10)<<"errors"
+	   <<std::setw(14)<<"peak RSS MB"<<std::endl;
+
+  for(size_t nthreads = 1; ; nthreads *= 2){
+    if(nthreads > cfg.maxthreads)
+      nthreads = cfg.maxthreads;
+    std::vector<ThreadResult> results(nthreads);
+    std::vector<std::thread> threads;
+    auto start = steady::now();
+    auto end = start + std::chrono::duration_cast<steady::duration>
+      (std::chrono::duration<double>(cfg.seconds));
+    for(size_t t=0; t<nthreads; ++t)
+      threads.emplace_back(producer, std::cref(cfg), std::ref(fleet),
+			   unsigned(1000 + t), end, std::ref(results[t]));
+    for(auto& th : threads)
+      th.join();
+    double elapsed = std::chrono::duration<double>(steady::now()-start)
+      .count();
+
+    Histogram all;
+    size_t nevents = 0, nallocs = 0, nerrors = 0;
+    for(auto& r : results){
+      all.Merge(r.latency);
+      nevents += r.nevents;
+      nallocs += r.nallocs;
+      nerrors += r.nerrors;
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::cout<<std::fixed<<std::setprecision(1)
+	     <<std::setw(8)<<nthreads<<std::setw(14)<<nevents/elapsed
+	     <<std::setw(10)<<all.Percentile(0.5)/1e3
+	     <<std::setw(10)<<all.Percentile(0.99)/1e3
+	     <<std::setw(11)<<all.Percentile(0.999)/1e3
+	     <<std::setw(11)<<all.GetMax()/1e3
+	     <<std::setw(14)<<nallocs/elapsed<<std::setw(10)<<nerrors
+	     <<std::setw(14)<<usage.ru_maxrss/1024.<<std::endl;
+    if(nthreads == cfg.maxthreads)
+      break;
+  }
+  //flush what is queued and go back to the default sink
+  SetLogSink(nullptr);
+  return 0;
+}
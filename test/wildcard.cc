@@ -0,0 +1,64 @@
+#include <cassert>
+#include <iostream>
+#include "StateMachine.hh"
+
+using namespace fsm;
+
+int naudit = 0, nconnect = 0, nany = 0;
+
+void audit(){ ++naudit; }
+void connect(){ ++nconnect; }
+void any(){ ++nany; }
+
+//keeps its own count, so it notices if it is ever called through a copy
+int lastcount = 0;
+struct Counting{
+  int n = 0;
+  stateid_t operator()(VState*, const Message&){
+    lastcount = ++n;
+    return nullstate;
+  }
+};
+
+int main()
+{
+  assert(StateMachine::MatchEvent("net::*", "net::tcp::CONNECT"));
+  assert(StateMachine::MatchEvent("*::CONNECT", "net::tcp::CONNECT"));
+  assert(StateMachine::MatchEvent("net::*::CONNECT", "net::tcp::CONNECT"));
+  assert(StateMachine::MatchEvent("*", ""));
+  assert(!StateMachine::MatchEvent("net::*", "simple::POLL"));
+  assert(!StateMachine::MatchEvent("net::*::CONNECT", "net::tcp::CLOSE"));
+
+  StateMachine sm;
+  sm.RegisterEventHandler("net::tcp::CONNECT", connect);
+  sm.Handle("net::tcp::CONNECT");
+  assert(nconnect == 1);
+
+  //patterns added after the first dispatch must still be picked up
+  sm.RegisterEventHandler("net::*", audit, StateMachine::SEQ_FIRST);
+  sm.RegisterEventHandler("*", any, StateMachine::SEQ_LAST);
+  sm.Handle("net::tcp::CONNECT");
+  sm.Handle("net::udp::SEND");
+  sm.Handle("simple::POLL");
+  assert(nconnect == 2 && naudit == 2 && nany == 3);
+
+  assert(sm.RemoveAllHandlers("net::*") == 1);
+  sm.Handle("net::tcp::CONNECT");
+  assert(nconnect == 3 && naudit == 2 && nany == 4);
+
+  //exact handlers keep their state when merged with patterns, even across
+  //registration changes that rebuild the merged sequences
+  StateMachine sm2;
+  sm2.RegisterEventHandler("net::tcp::CLOSE", EventHandler(Counting()));
+  sm2.RegisterEventHandler("net::*", audit);
+  sm2.Handle("net::tcp::CLOSE");
+  assert(lastcount == 1);
+  sm2.RegisterEventHandler("*", any);
+  sm2.Handle("net::tcp::CLOSE");
+  sm2.RemoveEventHandler("*", StateMachine::SEQ_DEFAULT);
+  sm2.Handle("net::tcp::CLOSE");
+  assert(lastcount == 3);
+
+  std::cout<<"wildcard.cc: OK"<<std::endl;
+  return 0;
+}
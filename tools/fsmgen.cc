@@ -0,0 +1,352 @@
+/** fsmgen: generate specialized dispatch code from a declarative machine spec
+
+    usage: fsmgen <spec file> <output header>
+
+    Spec format, one directive per line, '#' starts a comment:
+
+      machine <Name>                  namespace of the generated code
+      include <"file"|<file>>         header declaring state types and handlers
+      state <Type> [name]             state class, as for RegisterState
+      event <ID> <label>              event label, as passed to Handle
+      on <Type|*> <ID> [call <func>] [seq <n>] [-> <Type>]
+                                      handler rule; `*` fires in any state.
+				      `func` must be callable as
+				      void(fsm::VState*, const fsm::Message&)
+
+    The generated header contains, in namespace <Name>_fsm:
+      - dense `State` and `Event` enums
+      - LookupEvent(), a perfect-hash map from label to Event
+      - Dispatch(), a switch calling each handler directly; transitions are
+        resolved at generation time using the same sequence and override
+        rules as StateMachine::Handle
+      - Register(), which registers the same machine into a StateMachine
+*/
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+struct StateSpec{ std::string type, name; };
+struct EventSpec{ std::string id, label; };
+struct RuleSpec{
+  int state;            ///< index into states, -1 for any
+  int event;
+  std::string func;     ///< may be empty for a pure transition
+  int sequence = 50;
+  int target = -1;      ///< -1 for no transition
+  size_t order;         ///< declaration order, to keep ties stable
+};
+
+struct Spec{
+  std::string machine;
+  std::vector<std::string> includes;
+  std::vector<StateSpec> states;
+  std::vector<EventSpec> events;
+  std::vector<RuleSpec> rules;
+};
+
+static void fail(const std::string& file, int line, const std::string& msg)
+{
+  std::cerr<<file<<':'<<line<<": "<<msg<<std::endl;
+  exit(1);
+}
+
+static int findstate(const Spec& spec, const std::string& type)
+{
+  for(size_t i=0; i<spec.states.size(); ++i)
+    if(spec.states[i].type == type) return i;
+  return -1;
+}
+
+static int findevent(const Spec& spec, const std::string& id)
+{
+  for(size_t i=0; i<spec.events.size(); ++i)
+    if(spec.events[i].id == id) return i;
+  return -1;
+}
+
+static Spec parse(const std::string& file)
+{
+  std::ifstream in(file);
+  if(!in)
+    fail(file, 0, "unable to open");
+  Spec spec;
+  std::string text;
+  for(int lineno=1; std::getline(in, text); ++lineno){
+    text = text.substr(0, text.find('#'));
+    std::istringstream line(text);
+    std::string cmd;
+    if(!(line>>cmd))
+      continue;
+    if(cmd == "machine"){
+      line>>spec.machine;
+    }
+    else if(cmd == "include"){
+      std::string inc;
+      line>>inc;
+      spec.includes.push_back(inc);
+    }
+    else if(cmd == "state"){
+      StateSpec st;
+      if(!(line>>st.type))
+	fail(file, lineno, "state needs a type");
+      if(!(line>>st.name))
+	st.name = st.type;
+      if(findstate(spec, st.type) >= 0)
+	fail(file, lineno, "duplicate state "+st.type);
+      spec.states.push_back(st);
+    }
+    else if(cmd == "event"){
+      EventSpec evt;
+      if(!(line>>evt.id>>evt.label))
+	fail(file, lineno, "event needs an ID and a label");
+      if(findevent(spec, evt.id) >= 0)
+	fail(file, lineno, "duplicate event "+evt.id);
+      for(auto& other : spec.events)
+	if(other.label == evt.label)
+	  fail(file, lineno, "event "+evt.id+" has the same label as "+other.id);
+      spec.events.push_back(evt);
+    }
+    else if(cmd == "on"){
+      RuleSpec rule;
+      std::string st, evt, word;
+      if(!(line>>st>>evt))
+	fail(file, lineno, "on needs a state and an event");
+      rule.state = st == "*" ? -1 : findstate(spec, st);
+      if(st != "*" && rule.state < 0)
+	fail(file, lineno, "unknown state "+st);
+      rule.event = findevent(spec, evt);
+      if(rule.event < 0)
+	fail(file, lineno, "unknown event "+evt);
+      while(line>>word){
+	if(word == "call" && line>>rule.func) continue;
+	if(word == "seq" && line>>rule.sequence) continue;
+	if(word == "->" && line>>word){
+	  rule.target = findstate(spec, word);
+	  if(rule.target < 0)
+	    fail(file, lineno, "unknown state "+word);
+	  continue;
+	}
+	fail(file, lineno, "unexpected '"+word+"'");
+      }
+      rule.order = spec.rules.size();
+      spec.rules.push_back(rule);
+    }
+    else
+      fail(file, lineno, "unknown directive "+cmd);
+  }
+  if(spec.machine.empty())
+    fail(file, 0, "no machine name given");
+  if(spec.states.empty() || spec.states.size() > 254)
+    fail(file, 0, "need between 1 and 254 states");
+  if(spec.events.empty() || spec.events.size() > 254)
+    fail(file, 0, "need between 1 and 254 events");
+  //same order StateMachine::Handle will use
+  std::stable_sort(spec.rules.begin(), spec.rules.end(),
+		   [](const RuleSpec& a, const RuleSpec& b)
+		   { return a.sequence < b.sequence; });
+  return spec;
+}
+
+static uint32_t fnv1a(uint32_t seed, const std::string& s)
+{
+  uint32_t h = seed;
+  for(unsigned char c : s){
+    h ^= c;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+///Find a seed and power-of-2 table size with no collisions among the labels
+static void perfecthash(const Spec& spec, uint32_t& seed,
+			std::vector<int>& table)
+{
+  size_t size = 2;
+  while(size < 2*spec.events.size()) size <<= 1;
+  //labels are distinct, so this only gives up if the hash is badly broken
+  for(; size <= 1<<16; size <<= 1){
+    for(uint32_t tryseed = 0; tryseed < 100000; ++tryseed){
+      seed = 2166136261u ^ tryseed;
+      table.assign(size, -1);
+      bool ok = true;
+      for(size_t i=0; ok && i<spec.events.size(); ++i){
+	int& slot = table[fnv1a(seed, spec.events[i].label) & (size-1)];
+	if(slot >= 0) ok = false;
+	else slot = i;
+      }
+      if(ok)
+	return;
+    }
+  }
+  std::cerr<<"unable to find a perfect hash for the event labels"<<std::endl;
+  exit(1);
+}
+
+static std::string quote(const std::string& s)
+{
+  std::string out = "\"";
+  for(char c : s){
+    if(c == '"' || c == '\\') out += '\\';
+    out += c;
+  }
+  return out + '"';
+}
+
+static void generate(const Spec& spec, const std::string& specfile,
+		     std::ostream& out)
+{
+  const std::string ns = spec.machine + "_fsm";
+  const std::string guard = "FSMGEN_" + spec.machine + "_h";
+  const size_t nstates = spec.states.size(), nevents = spec.events.size();
+
+  out<<"// Generated by fsmgen from "<<specfile<<"; do not edit\n"
+     <<"#ifndef "<<guard<<"\n#define "<<guard<<"\n\n"
+     <<"#include <cstdint>\n#include <cstring>\n"
+     <<"#include \"StateMachine.hh\"\n";
+  for(auto& inc : spec.includes)
+    out<<"#include "<<inc<<'\n';
+  out<<"\nnamespace "<<ns<<"{\n\n";
+
+  out<<"  enum State : uint8_t {\n";
+  for(size_t i=0; i<nstates; ++i)
+    out<<"    S_"<<spec.states[i].type<<" = "<<i<<",\n";
+  out<<"    NSTATES = "<<nstates<<",\n    NOSTATE = 255,\n  };\n\n";
+
+  out<<"  enum Event : uint8_t {\n";
+  for(size_t i=0; i<nevents; ++i)
+    out<<"    E_"<<spec.events[i].id<<" = "<<i<<",\n";
+  out<<"    NEVENTS = "<<nevents<<",\n    NOEVENT = 255,\n  };\n\n";
+
+  out<<"  static const char* const state_names[NSTATES] = {\n";
+  for(auto& st : spec.states)
+    out<<"    "<<quote(st.name)<<",\n";
+  out<<"  };\n\n";
+  out<<"  static const char* const event_labels[NEVENTS] = {\n";
+  for(auto& evt : spec.events)
+    out<<"    "<<quote(evt.label)<<",\n";
+  out<<"  };\n\n";
+
+  uint32_t seed;
+  std::vector<int> table;
+  perfecthash(spec, seed, table);
+  out<<"  ///Map an event label to its Event, or NOEVENT if not in the spec\n"
+     <<"  inline Event LookupEvent(const char* label, size_t len){\n"
+     <<"    static const uint8_t slots["<<table.size()<<"] = {";
+  for(size_t i=0; i<table.size(); ++i)
+    out<<(i%16 ? " " : "\n      ")<<(table[i] < 0 ? 255 : table[i])<<',';
+  out<<"\n    };\n"
+     <<"    static const size_t lengths[NEVENTS] = {";
+  for(size_t i=0; i<nevents; ++i)
+    out<<(i%16 ? " " : "\n      ")<<spec.events[i].label.size()<<',';
+  out<<"\n    };\n"
+     <<"    uint32_t h = "<<seed<<"u;\n"
+     <<"    for(size_t i=0; i<len; ++i){\n"
+     <<"      h ^= (unsigned char)label[i];\n"
+     <<"      h *= 16777619u;\n"
+     <<"    }\n"
+     <<"    uint8_t e = slots[h & "<<table.size()-1<<"];\n"
+     <<"    if(e != NOEVENT && lengths[e] == len &&\n"
+     <<"       memcmp(event_labels[e], label, len) == 0)\n"
+     <<"      return Event(e);\n"
+     <<"    return NOEVENT;\n"
+     <<"  }\n\n"
+     <<"  inline Event LookupEvent(const fsm::event_t& label)\n"
+     <<"  { return LookupEvent(label.data(), label.size()); }\n\n";
+
+  out<<"  /** Handle `evt` in state `cur` and return the resulting state.\n"
+     <<"      No state objects are created; `st` is passed through to the\n"
+     <<"      handlers as-is and may be null if they don't use it.\n"
+     <<"  */\n"
+     <<"  inline State Dispatch(State cur, Event evt, fsm::VState* st,\n"
+     <<"                        const fsm::Message& msg){\n"
+     <<"    (void)st; (void)msg;\n"
+     <<"    switch(evt){\n";
+  for(size_t e=0; e<nevents; ++e){
+    out<<"    case E_"<<spec.events[e].id<<":\n"
+       <<"      switch(cur){\n";
+    for(size_t s=0; s<nstates; ++s){
+      //walk the rules as Handle would, tracking the state statically
+      std::ostringstream body;
+      int current = s;
+      for(auto& rule : spec.rules){
+	if(rule.event != (int)e || (rule.state >= 0 && rule.state != current))
+	  continue;
+	if(!rule.func.empty())
+	  body<<"        "<<rule.func<<"(st, msg);\n";
+	if(rule.target >= 0)
+	  current = rule.target;
+	if(rule.sequence < 0)
+	  break;
+      }
+      if(body.str().empty() && current == (int)s)
+	continue;
+      out<<"      case S_"<<spec.states[s].type<<":\n"<<body.str()
+	 <<"        return S_"<<spec.states[current].type<<";\n";
+    }
+    out<<"      default: return cur;\n"
+       <<"      }\n";
+  }
+  out<<"    default: return cur;\n"
+     <<"    }\n"
+     <<"  }\n\n";
+
+  out<<"  ///Convert between State and the StateMachine state ID\n"
+     <<"  inline fsm::stateid_t ToStateID(State s){\n"
+     <<"    switch(s){\n";
+  for(auto& st : spec.states)
+    out<<"    case S_"<<st.type<<": return fsm::GetStateID< ::"<<st.type
+       <<">();\n";
+  out<<"    default: return fsm::nullstate;\n"
+     <<"    }\n"
+     <<"  }\n\n"
+     <<"  inline State FromStateID(const fsm::stateid_t& id){\n";
+  for(auto& st : spec.states)
+    out<<"    if(id == fsm::GetStateID< ::"<<st.type<<">()) return S_"
+       <<st.type<<";\n";
+  out<<"    return NOSTATE;\n"
+     <<"  }\n\n";
+
+  out<<"  ///Register the same machine into a regular StateMachine\n"
+     <<"  inline void Register(fsm::StateMachine& sm){\n";
+  for(auto& st : spec.states)
+    out<<"    sm.RegisterState< ::"<<st.type<<">("<<quote(st.name)<<");\n";
+  for(auto& rule : spec.rules){
+    out<<"    sm.RegisterEventHandler("<<quote(spec.events[rule.event].label)
+       <<", fsm::EventHandler(\n"
+       <<"      [](fsm::VState* st, const fsm::Message& msg){\n"
+       <<"        (void)st; (void)msg;\n";
+    if(!rule.func.empty())
+      out<<"        "<<rule.func<<"(st, msg);\n";
+    out<<"        return "<<(rule.target >= 0 ?
+			     "fsm::GetStateID< ::"+spec.states[rule.target].type
+			     +">()" : std::string("fsm::nullstate"))<<";\n"
+       <<"      }), "<<rule.sequence<<", "
+       <<(rule.state >= 0 ?
+	  "fsm::GetStateID< ::"+spec.states[rule.state].type+">()" :
+	  std::string("fsm::nullstate"))<<");\n";
+  }
+  out<<"  }\n\n"
+     <<"}\n\n#endif\n";
+}
+
+int main(int argc, char** argv)
+{
+  if(argc != 3){
+    std::cerr<<"usage: "<<argv[0]<<" <spec file> <output header>"<<std::endl;
+    return 2;
+  }
+  Spec spec = parse(argv[1]);
+  std::ofstream out(argv[2]);
+  if(!out){
+    std::cerr<<"unable to write "<<argv[2]<<std::endl;
+    return 1;
+  }
+  generate(spec, argv[1], out);
+  return out ? 0 : 1;
+}
@@ -0,0 +1,81 @@
+/** fsmsym: replace state and event indices in trace output with names
+
+    usage: fsmsym <symbol map>... < trace.txt
+
+    Symbol maps are written by StateMachine::WriteSymbolMap. Each input line
+    is copied to stdout with every `state=N` and `event=N` rewritten as
+    `state=Name` / `event=label`. If the line also has a `machine=0x...`
+    field, that machine's tables are used; otherwise the first map read.
+*/
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <map>
+#include <cstdlib>
+
+struct Symbols{
+  std::map<long, std::string> states, events;
+};
+
+int main(int argc, char** argv)
+{
+  if(argc < 2){
+    std::cerr<<"usage: "<<argv[0]<<" <symbol map>... < trace.txt"<<std::endl;
+    return 2;
+  }
+  std::map<std::string, Symbols> machines;
+  std::string first;
+  for(int i=1; i<argc; ++i){
+    std::ifstream in(argv[i]);
+    if(!in){
+      std::cerr<<"unable to open "<<argv[i]<<std::endl;
+      return 1;
+    }
+    std::string line, kind, current;
+    while(std::getline(in, line)){
+      std::istringstream fields(line);
+      long index;
+      if(!(fields>>kind))
+	continue;
+      if(kind == "machine"){
+	fields>>current;
+	if(first.empty()) first = current;
+	continue;
+      }
+      if(!(fields>>index))
+	continue;
+      std::string name;
+      std::getline(fields>>std::ws, name);
+      Symbols& sym = machines[current];
+      (kind == "state" ? sym.states : sym.events)[index] = name;
+    }
+  }
+
+  std::string line;
+  while(std::getline(std::cin, line)){
+    const Symbols* sym = &machines[first];
+    size_t m = line.find("machine=");
+    if(m != std::string::npos){
+      std::string addr = line.substr(m+8, line.find_first_of(" \t,", m)-m-8);
+      auto it = machines.find(addr);
+      if(it != machines.end())
+	sym = &it->second;
+    }
+    for(auto& key : {std::string("state="), std::string("event=")}){
+      const auto& table = key == "state=" ? sym->states : sym->events;
+      for(size_t pos = line.find(key); pos != std::string::npos;
+	  pos = line.find(key, pos+1)){
+	size_t start = pos + key.size();
+	char* end;
+	long index = strtol(line.c_str()+start, &end, 10);
+	size_t len = end - (line.c_str()+start);
+	auto it = table.find(index);
+	if(len && it != table.end())
+	  line.replace(start, len, it->second);
+      }
+    }
+    std::cout<<line<<'\n';
+  }
+  return 0;
+}